@@ -0,0 +1,159 @@
+/* The MIT License (MIT)
+
+  Copyright (c) 2017 Madis Kaal <mast@nomad.ee>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+#ifndef __autotune_hpp__
+#define __autotune_hpp__
+
+#include <stdint.h>
+#include <math.h>
+
+// number of oscillation cycles averaged for the result, and the
+// number of cycles discarded before that while oscillation settles
+#define AUTOTUNE_CYCLES 3
+#define AUTOTUNE_SETTLE 1
+
+// autotune is aborted if it does not complete in this many seconds, or
+// temperature goes this much over setpoint
+#define AUTOTUNE_TIMEOUT 1800
+#define AUTOTUNE_OVERSHOOT 40
+#define AUTOTUNE_HYSTERESIS 1.0
+
+// relay feedback (Astrom-Hagglund) PID tuner. heater is switched fully
+// on below setpoint and off above it, with some hysteresis to keep noise
+// from switching it. this makes the oven oscillate around the setpoint,
+// and the amplitude and period of that give the ultimate gain and period
+// the tuning rules need. samples must come once per second, as this is
+// what PID runs at, so the period is also the right unit for Ki and Kd
+//
+class RelayTuner
+{
+  float sp,hysteresis;
+  int16_t high,low;     // relay outputs
+  bool heating;
+  uint8_t cycles;       // switches to heating seen
+  int32_t lastswitch;   // time of last switch to heating
+  float vmax,vmin;      // extremes seen during current cycle
+  float amplitudes;     // sum of measured amplitudes
+  int32_t periods;      // sum of measured periods
+
+public:
+
+  enum RULE { ZIEGLER_NICHOLS, TYREUS_LUYBEN, NO_OVERSHOOT, RULES };
+
+  RelayTuner()
+  {
+    Start(0.0,0.0,0,0);
+  }
+
+  void Start(float setpoint,float hyst,int16_t outhigh,int16_t outlow)
+  {
+    sp=setpoint;
+    hysteresis=hyst;
+    high=outhigh;
+    low=outlow;
+    heating=true;
+    cycles=0;
+    lastswitch=0;
+    vmax=vmin=setpoint;
+    amplitudes=0.0;
+    periods=0;
+  }
+
+  // process next sample taken at time t (seconds), returns relay output
+  int16_t Sample(int32_t t,float v)
+  {
+    if (v>vmax)
+      vmax=v;
+    if (v<vmin)
+      vmin=v;
+    if (heating) {
+      if (v>sp+hysteresis)
+        heating=false;
+    }
+    else if (v<sp-hysteresis) {
+      heating=true;
+      if (cycles>AUTOTUNE_SETTLE) {
+        amplitudes+=(vmax-vmin)/2.0;
+        periods+=t-lastswitch;
+      }
+      cycles++;
+      lastswitch=t;
+      vmax=vmin=v;
+    }
+    return heating?high:low;
+  }
+
+  bool Done()
+  {
+    return cycles>AUTOTUNE_SETTLE+AUTOTUNE_CYCLES;
+  }
+
+  // oscillation amplitude (degc) and period (seconds)
+  float Amplitude()
+  {
+    return amplitudes/AUTOTUNE_CYCLES;
+  }
+
+  float Period()
+  {
+    return (float)periods/AUTOTUNE_CYCLES;
+  }
+
+  // ultimate gain from describing function of relay with hysteresis
+  float UltimateGain()
+  {
+    float a=Amplitude();
+    if (a<=hysteresis)
+      return 0.0;
+    return 4.0*(high-low)/2.0/(M_PI*sqrt(a*a-hysteresis*hysteresis));
+  }
+
+  // PID coefficents by given tuning rule. the controller adds Ki*e
+  // to integral and Kd*(e-previous e) to output on every sample, so
+  // Ki=Kp/Ti and Kd=Kp*Td with Ti and Td in samples
+  void Coefficents(RULE rule,float& kp,float& ki,float& kd)
+  {
+    float ku=UltimateGain(),tu=Period(),ti,td;
+    switch (rule) {
+      case TYREUS_LUYBEN:
+        kp=ku/2.2;
+        ti=tu*2.2;
+        td=tu/6.3;
+        break;
+      case NO_OVERSHOOT:
+        kp=ku*0.2;
+        ti=tu/2.0;
+        td=tu/3.0;
+        break;
+      default:
+        kp=ku*0.6;
+        ti=tu/2.0;
+        td=tu/8.0;
+        break;
+    }
+    ki=ti>0.0?kp/ti:0.0;
+    kd=kp*td;
+  }
+
+};
+
+#endif
@@ -0,0 +1,549 @@
+/* The MIT License (MIT)
+
+  Copyright (c) 2017 Madis Kaal <mast@nomad.ee>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include <avr/pgmspace.h>
+
+#include "pid.hpp"
+#include "predictive.hpp"
+#include "serial.hpp"
+#include "temperaturesensor.hpp"
+#include "oven.hpp"
+#include "process.hpp"
+#include "settings.hpp"
+
+#ifndef __AVR__
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+// microbenchmarks for the control code hot paths. on host the kernels
+// run against stub registers and are timed with the monotonic clock, and
+// results can be saved and compared to catch regressions. built for AVR
+// each call is timed in cycles with timer1 and results go out on serial
+// port, so running it in simavr gives exact ATmega328p cycle counts
+//
+
+Button startbutton;
+Button profilebutton;
+Serial serial;
+Servo doorservo;
+Settings settings;
+Oven oven;
+volatile uint16_t tick_counter;
+int32_t second_counter;
+uint32_t uptime;
+
+// autotune saves its results through these, never run here
+void ReadSettings()
+{
+}
+
+void WriteSettings()
+{
+}
+
+#ifndef __AVR__
+// stub registers are polled, nothing to sleep for
+void sleep_cpu(void)
+{
+}
+#endif
+
+// ProcessTick() and friends are private, this gets to them
+struct Benchmark
+{
+  static void BeginProfile(Process& p,const Profile *profile)
+  {
+    p.SetProfile(profile);
+  }
+  static void Tick(Process& p)
+  {
+    p.ProcessTick();
+    if (p.state==Process::STOPPING) {
+      p.state=Process::RUNNING;
+      p.nextstep=p.profile.steps;
+      p.NextStep();
+    }
+  }
+  static int32_t Setpoint(Process& p)
+  {
+    return p.setpoint;
+  }
+  static bool Telemetry(Process& p,float v)
+  {
+    return p.SendTelemetry(v);
+  }
+};
+
+static const ProfileStep benchsteps[] PROGMEM = {
+  PROFILE_STEP(25,150,100,0),
+  PROFILE_STEP(150,180,60,0),
+  PROFILE_STEP(180,230,50,0),
+  PROFILE_STEP(230,60,60,0),
+  PROFILE_DONE
+};
+
+static const Profile benchprofile PROGMEM = { benchsteps,160,200 };
+
+static PID pid(16.0,0.05,2.1);
+static FixedPID fixedpid(16.0,0.05,2.1);
+static PIDController scheduledpid(16.0,0.05,2.1);
+static PredictiveController predictive;
+static Process process;
+static volatile int32_t sink;
+static float benchtemp;
+
+// kernels, each call does one unit of work with slightly varying input
+
+static void PidFloat()
+{
+  benchtemp+=0.25;
+  if (benchtemp>250.0)
+    benchtemp=20.0;
+  sink+=pid.ProcessInput(benchtemp);
+}
+
+static void PidFixed()
+{
+  benchtemp+=0.25;
+  if (benchtemp>250.0)
+    benchtemp=20.0;
+  sink+=fixedpid.ProcessInput(benchtemp);
+}
+
+static void PidRate()
+{
+  benchtemp+=0.25;
+  if (benchtemp>250.0)
+    benchtemp=20.0;
+  sink+=pid.ProcessInput(benchtemp,0.5);
+}
+
+static void PidScheduled()
+{
+  benchtemp+=0.25;
+  if (benchtemp>250.0)
+    benchtemp=20.0;
+  sink+=scheduledpid.ProcessInput(benchtemp);
+}
+
+static void Predictive()
+{
+  benchtemp+=0.25;
+  if (benchtemp>250.0)
+    benchtemp=20.0;
+  sink+=predictive.ProcessInput(benchtemp,150.0,1.0,180.0);
+}
+
+static uint16_t reading=100<<5;
+
+static void SensorAverage()
+{
+  reading=(reading+(7<<3))&0x7ff8;
+  oven.Sensor().Update(reading);
+  sink+=oven.Sensor().ReadQuarters();
+}
+
+static void SensorAlphaBeta()
+{
+  reading=(reading+(7<<3))&0x7ff8;
+  oven.Sensor().Update(reading);
+  sink+=oven.Sensor().ReadQuarters();
+}
+
+static void PrintFloat()
+{
+  benchtemp+=0.25;
+  if (benchtemp>250.0)
+    benchtemp=20.0;
+  serial.print(benchtemp);
+  while (serial.txfree()<SERIAL_TXBUFSIZE-1)
+    serial.TxInterrupt();
+}
+
+static void PrintInt()
+{
+  serial.print((int32_t)sink);
+  while (serial.txfree()<SERIAL_TXBUFSIZE-1)
+    serial.TxInterrupt();
+}
+
+static void ProcessTick()
+{
+  // oven follows the setpoint so that steps complete
+  oven.Sensor().Update((uint16_t)(Benchmark::Setpoint(process)>>6)<<3);
+  Benchmark::Tick(process);
+}
+
+static void TelemetryLine()
+{
+  benchtemp+=0.25;
+  if (benchtemp>250.0)
+    benchtemp=20.0;
+  second_counter++;
+  Benchmark::Telemetry(process,benchtemp);
+  while (serial.txfree()<SERIAL_TXBUFSIZE-1)
+    serial.TxInterrupt();
+}
+
+static void OvenPwm()
+{
+  oven.Run();
+}
+
+// fixed amount of plain integer work, host results are compared
+// relative to this to cancel out host clock speed changes
+static void Reference()
+{
+  for (uint8_t i=0;i<64;i++)
+    sink+=i;
+}
+
+struct Kernel {
+  const char *name;
+  void (*setup)();
+  void (*run)();
+};
+
+static void SetupNone()
+{
+}
+
+static void SetupAverage()
+{
+  oven.Sensor().SetFilter(SENSOR_AVERAGE);
+}
+
+static void SetupAlphaBeta()
+{
+  oven.Sensor().SetFilter(SENSOR_ALPHABETA);
+}
+
+static void SetupPid()
+{
+  pid.SetOutputLimits(-127,127);
+  pid.SetSetPoint(150.0);
+  fixedpid.SetOutputLimits(-127,127);
+  fixedpid.SetSetPoint(150.0);
+  benchtemp=20.0;
+}
+
+static void SetupScheduledPid()
+{
+  GainBand critical={ 160,200,24.0,0.08,4.0 };
+  GainBand ramp={ 100,150,10.0,0.02,1.0 };
+  scheduledpid.SetOutputLimits(-127,127);
+  scheduledpid.SetSetPoint(150.0);
+  scheduledpid.schedule.SetBand(0,critical);
+  scheduledpid.schedule.SetBand(1,ramp);
+  benchtemp=20.0;
+}
+
+static void SetupPredictive()
+{
+  predictive.SetModel(2.5,200.0,8,25.0);
+  predictive.Reset();
+  benchtemp=20.0;
+}
+
+static void SetupProcess()
+{
+  oven.Sensor().SetFilter(SENSOR_ALPHABETA);
+  oven.Sensor().Update(25<<5);
+  Benchmark::BeginProfile(process,&benchprofile);
+}
+
+static void SetupPwm()
+{
+  oven.SetModulation(HEATER_PWM,0);
+  oven.SetPWM(50);
+}
+
+static void SetupSigmaDelta()
+{
+  oven.SetModulation(HEATER_SIGMADELTA,3);
+  oven.SetPWM(50);
+}
+
+static const Kernel kernels[]={
+  { "reference",SetupNone,Reference },
+  { "pid_float",SetupPid,PidFloat },
+  { "pid_fixed",SetupPid,PidFixed },
+  { "pid_rate",SetupPid,PidRate },
+  { "pid_scheduled",SetupScheduledPid,PidScheduled },
+  { "predictive",SetupPredictive,Predictive },
+  { "sensor_average",SetupAverage,SensorAverage },
+  { "sensor_alphabeta",SetupAlphaBeta,SensorAlphaBeta },
+  { "print_float",SetupNone,PrintFloat },
+  { "print_int",SetupNone,PrintInt },
+  { "process_tick",SetupProcess,ProcessTick },
+  { "telemetry_line",SetupProcess,TelemetryLine },
+  { "oven_pwm",SetupPwm,OvenPwm },
+  { "oven_sigmadelta",SetupSigmaDelta,OvenPwm },
+};
+
+#ifdef __AVR__
+
+// calls are timed one at a time with timer1 running at F_CPU, the
+// overhead of reading the timer is measured first and subtracted
+#define BENCH_CALLS 64
+
+int main(void)
+{
+  uint16_t start,t,overhead,min,max;
+  uint32_t total;
+  serial.enable();
+  TCCR1A=0;
+  TCCR1B=_BV(CS10);
+  start=TCNT1;
+  overhead=TCNT1-start;
+  serial.print(FSTR("\n#kernel,min,mean,max cycles\n"));
+  for (uint8_t k=0;k<COUNTOF(kernels);k++) {
+    kernels[k].setup();
+    min=0xffff;
+    max=0;
+    total=0;
+    for (uint8_t i=0;i<BENCH_CALLS;i++) {
+      start=TCNT1;
+      kernels[k].run();
+      t=TCNT1-start-overhead;
+      if (t<min)
+        min=t;
+      if (t>max)
+        max=t;
+      total+=t;
+    }
+    serial.print(kernels[k].name);
+    serial.send(',');
+    serial.print((int32_t)min);
+    serial.send(',');
+    serial.print((int32_t)(total/BENCH_CALLS));
+    serial.send(',');
+    serial.print((int32_t)max);
+    serial.send('\n');
+  }
+  serial.print(FSTR("#done\n"));
+  // interrupts stay off so that they do not disturb the timing, the
+  // transmit buffer is emptied by polling before stopping. sleeping with
+  // interrupts disabled never wakes up, simavr takes it as a clean exit
+  while (serial.txfree()<SERIAL_TXBUFSIZE-1)
+    serial.wait();
+  cli();
+  sleep_enable();
+  sleep_cpu();
+}
+
+#else
+
+// kernels are timed in rounds, each round going through all of them, and
+// the fastest round of each is taken. anything else running on host only
+// ever makes rounds slower, and slow periods hit all kernels alike
+#define BENCH_ROUNDS 15
+#define BENCH_ROUNDTIME 0.01
+
+static double Now()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID,&t);
+  return t.tv_sec+t.tv_nsec*1e-9;
+}
+
+// times a batch of calls, returns nanoseconds per call
+static double Round(const Kernel& k,long batch)
+{
+  double start=Now();
+  for (long i=0;i<batch;i++)
+    k.run();
+  return (Now()-start)*1e9/batch;
+}
+
+// finds a batch size that takes about a round time
+static long BatchSize(const Kernel& k)
+{
+  long batch=1000;
+  k.setup();
+  while (Round(k,batch)*batch<BENCH_ROUNDTIME*1e9)
+    batch*=2;
+  return batch;
+}
+
+// looks up kernel result in saved baseline, returns negative if none
+static double Baseline(const char *file,const char *name)
+{
+  char line[128],n[64];
+  double v,r=-1.0;
+  FILE *f=fopen(file,"r");
+  if (!f)
+    return r;
+  while (fgets(line,sizeof line,f))
+    if (sscanf(line,"%63s %lf",n,&v)==2 && !strcmp(n,name))
+      r=v;
+  fclose(f);
+  return r;
+}
+
+// fixed point PID must give the same output as the float one, give or
+// take a count of rounding. both are driven with the same temperature
+// trace, a profile like ramp with a lagging and wobbling oven read in
+// quarter degrees, with a few gain sets, in both step transition modes
+// and with and without the rate input. returns the number of samples
+// that differ more
+#define CHECK_SAMPLES 600
+
+static int CheckFixedPoint()
+{
+  static const float gains[][3]={
+    { 16.0,0.05,2.1 },{ 10.0,0.02,1.0 },{ 24.0,0.08,4.0 },{ 2.0,0.0,0.0 } };
+  int bad=0,worst=0;
+  for (unsigned g=0;g<COUNTOF(gains);g++) {
+    for (int mode=0;mode<4;mode++) {
+      bool bumpless=mode&1,rate=mode&2;
+      PID f(gains[g][0],gains[g][1],gains[g][2]);
+      FixedPID x(gains[g][0],gains[g][1],gains[g][2]);
+      f.SetOutputLimits(bumpless?0:-127,127);
+      x.SetOutputLimits(bumpless?0:-127,127);
+      f.SetBumpless(bumpless);
+      x.SetBumpless(bumpless);
+      f.SetSetpointWeight(bumpless?0.9:1.0);
+      x.SetSetpointWeight(bumpless?0.9:1.0);
+      float oven=25.0,sp=25.0,prev=25.0;
+      for (int i=0;i<CHECK_SAMPLES;i++) {
+        if (i<200)
+          sp+=1.0;
+        else if (i>=400)
+          sp-=2.0;
+        if (sp<60.0)
+          sp=60.0;
+        if (!bumpless && (i%50)==0) {
+          f.Reset();
+          x.Reset();
+        }
+        f.SetSetPoint(sp);
+        x.SetSetPoint(sp);
+        oven+=(sp-oven)*0.05+0.6*sin(i*0.7);
+        float t=floor(oven*4.0+0.5)/4.0;
+        int a,b;
+        if (rate) {
+          a=f.ProcessInput(t,t-prev);
+          b=x.ProcessInput(t,t-prev);
+        }
+        else {
+          a=f.ProcessInput(t);
+          b=x.ProcessInput(t);
+        }
+        prev=t;
+        if (abs(a-b)>worst)
+          worst=abs(a-b);
+        if (abs(a-b)>1 && bad++<10)
+          printf("gains %.2f,%.2f,%.2f mode %d sample %d: float %d fixed %d\n",
+            gains[g][0],gains[g][1],gains[g][2],mode,i,a,b);
+      }
+    }
+  }
+  printf("fixed point PID: %d samples off by more than 1, largest difference %d\n",
+    bad,worst);
+  return bad;
+}
+
+static void Usage()
+{
+  fprintf(stderr,
+    "usage: bench [-s file] [-c file] [-r percent] [-p]\n"
+    "  -s file     save results as baseline\n"
+    "  -c file     compare against baseline, fail on regressions\n"
+    "  -r percent  slowdown counted as regression (%d)\n"
+    "  -p          check fixed point PID against float PID and exit\n",25);
+  exit(2);
+}
+
+int main(int argc,char *argv[])
+{
+  const char *save=NULL,*compare=NULL;
+  double limit=25.0,ns,base;
+  int c,regressions=0;
+  FILE *out=NULL;
+  while ((c=getopt(argc,argv,"s:c:r:ph"))!=-1) {
+    switch (c) {
+      case 's':
+        save=optarg;
+        break;
+      case 'c':
+        compare=optarg;
+        break;
+      case 'r':
+        limit=atof(optarg);
+        break;
+      case 'p':
+        return CheckFixedPoint()?1:0;
+      default:
+        Usage();
+    }
+  }
+  UCSR0A.value=_BV(UDRE0);
+  if (save && !(out=fopen(save,"w"))) {
+    perror(save);
+    return 2;
+  }
+  long batch[COUNTOF(kernels)];
+  double best[COUNTOF(kernels)];
+  for (unsigned k=0;k<COUNTOF(kernels);k++)
+    batch[k]=BatchSize(kernels[k]);
+  for (int r=0;r<BENCH_ROUNDS;r++) {
+    for (unsigned k=0;k<COUNTOF(kernels);k++) {
+      kernels[k].setup();
+      ns=Round(kernels[k],batch[k]);
+      if (!r || ns<best[k])
+        best[k]=ns;
+    }
+  }
+  // scale for host speed difference from baseline run
+  double scale=1.0;
+  if (compare && (base=Baseline(compare,kernels[0].name))>0.0)
+    scale=base/best[0];
+  for (unsigned k=0;k<COUNTOF(kernels);k++) {
+    ns=best[k];
+    printf("%-18s %10.1f ns",kernels[k].name,ns);
+    if (k && compare && (base=Baseline(compare,kernels[k].name))>0.0) {
+      ns*=scale;
+      printf("  %+6.1f%%",(ns-base)*100.0/base);
+      if (ns>base*(1.0+limit/100.0)) {
+        printf("  REGRESSION");
+        regressions++;
+      }
+    }
+    printf("\n");
+    if (out)
+      fprintf(out,"%s %.1f\n",kernels[k].name,best[k]);
+  }
+  if (out)
+    fclose(out);
+  return regressions?1:0;
+}
+
+#endif
@@ -24,7 +24,6 @@
 # on OSX, the dependencies you need are py-serial, py-matplotlib, py-numpy
 
 import serial
-from io import StringIO
 import matplotlib.pyplot as plt
 import numpy as np
 import sys
@@ -32,6 +31,11 @@ import time
 import tty
 import termios
 import select
+import binascii
+import struct
+import os
+import re
+import multiprocessing
 
 #derived from 
 # https://stackoverflow.com/questions/21791621/python-taking-input-from-sys-stdin-non-blocking
@@ -52,80 +56,494 @@ def getch():
   return ch
 
 # adjust the names as needed. The FDTI device naming below is from OSX built-in driver
-log=open("debug.log","a")
-ser=serial.Serial("/dev/tty.usbserial-A50285BI",38400)
+LOGFILE="debug.log"
+SERIALPORT="/dev/tty.usbserial-A50285BI"
 
-# on OSX the plot window does not properly close. when the chart window opens
-# you have to click on the red close button on window title for debug script to
-# continue but the plot window will remain open. when a new plot is made, then it
-# will replace the older one. The window will close after you break the debug
-# logging script
+# the chart window opens when a run starts and is redrawn as the run goes on,
+# logging continues while it is open. when the run stops the final chart stays
+# up until the next run replaces it, or the debug logging script is stopped
 
 #header row has names and formats
 # "time#i4,output#i4,value#f4,filteredvalue#f4"
+#
+#in binary telemetry mode the formats describe the packed record layout, and
+#may have a scale the value was multiplied with before sending
+# "time#<u2,value#<i2/16"
+#binary records come in frames starting with \x01, COBS encoded with
+#CRC-16/XMODEM appended, and terminated with \x00
+#
+#in delta telemetry mode the header is followed by a comment describing
+#delta records, which carry the change of each field since previous record
+# "#delta time#<u2,value#i1"
 
-def chart(csvtext):
-  header=csvtext.partition("\n")[0]
-  fields=header.split(",")
-  colors=['k-','b-','r-','g-','c-','m-']
+FRAMESTART='\x01'
+
+#record layout from binary telemetry header, None for text telemetry
+binformat=None
+#delta record layout, and the unscaled values of last decoded record that
+#deltas are added to
+deltaformat=None
+lastvalues=None
+
+#takes a header row, sets up binary record decoding if needed and returns
+#a header row for the text the records are decoded into
+def header(l):
+  global binformat
   names=[]
   formats=[]
-  for f in fields:
+  scales=[]
+  for f in l.split(","):
+    ff=f.split("#")
+    fs=ff[1].split("/")
+    names.append(ff[0])
+    formats.append(fs[0])
+    scales.append(float(fs[1]) if len(fs)>1 else None)
+  if not [f for f in formats if f.startswith("<") or f.startswith(">")] \
+     and not [s for s in scales if s]:
+    binformat=None
+    return l
+  binformat=(np.dtype({'names':names,'formats':formats}),scales)
+  textformats=[]
+  for f,s in zip(formats,scales):
+    if s or np.dtype(f).kind=='f':
+      textformats.append("f4")
+    else:
+      textformats.append("i4")
+  return ",".join(["%s#%s" % nf for nf in zip(names,textformats)])
+
+def deltaheader(l):
+  global deltaformat
+  names=[]
+  formats=[]
+  for f in l.split(","):
     ff=f.split("#")
     names.append(ff[0])
     formats.append(ff[1])
-  d=StringIO(unicode(csvtext))
-  data=np.loadtxt(d, delimiter=',',
-    dtype={'names':names,
-        'formats':formats},skiprows=1,unpack=False)
-
-  plt.close('all')
-  times=[]
-  for l in data:
-    times.append(l[0])
-  for f in range(1,len(names)):
-    rows=[]
-    for l in data:
-      rows.append(l[f])
-    plt.plot(times,rows,colors[f],label=names[f])
-  plt.legend(loc="upper left")
-  plt.xlabel("Time (seconds)")
-  plt.grid()
-  plt.show()
-  
-data=""
+  deltaformat=np.dtype({'names':names,'formats':formats})
+
+def cobsdecode(s):
+  out=""
+  i=0
+  while i<len(s):
+    n=ord(s[i])
+    if n==0 or i+n>len(s):
+      return None
+    out=out+s[i+1:i+n]
+    i=i+n
+    if i<len(s):
+      out=out+'\0'
+  return out
+
+#decodes a binary frame into a text row, returns None if the frame is broken.
+#after a broken frame delta records are skipped until next full record
+def decodeframe(frame):
+  global lastvalues
+  if binformat is None:
+    return None
+  data=cobsdecode(frame)
+  if data is None or binascii.crc_hqx(data,0)!=0:
+    lastvalues=None
+    return None
+  dtype,scales=binformat
+  if len(data)-2==dtype.itemsize:
+    rec=np.frombuffer(data[:-2],dtype=dtype)[0]
+    values=[v.item() for v in rec]
+  elif deltaformat is not None and len(data)-2==deltaformat.itemsize \
+       and lastvalues is not None:
+    rec=np.frombuffer(data[:-2],dtype=deltaformat)[0]
+    values=[a+d.item() for a,d in zip(lastvalues,rec)]
+  else:
+    lastvalues=None
+    return None
+  lastvalues=values
+  row=[]
+  for v,s in zip(values,scales):
+    if s:
+      row.append("%.3f" % (v/s))
+    else:
+      row.append(str(v))
+  return ",".join(row)
+
+def cobsencode(s):
+  out=""
+  for g in s.split('\0'):
+    out=out+chr(len(g)+1)+g
+  return out
+
+def encodeframe(data):
+  data=data+struct.pack(">H",binascii.crc_hqx(data,0))
+  return FRAMESTART+cobsencode(data)+'\0'
+
+#profile file for upload command, one step per line with temperature and
+#number of seconds, optionally preceded by door action. critical range is
+#given on a separate line, # starts a comment
+# critical 160 200
+# close 100 60
+# 150 40
+# open 60 60
+DOOR_OPEN=1
+DOOR_CLOSE=2
+
+def loadprofile(name):
+  low=high=0
+  steps=""
+  for l in open(name):
+    w=l.partition("#")[0].split()
+    if not w:
+      continue
+    if w[0]=="critical":
+      low,high=int(w[1]),int(w[2])
+      continue
+    flags=0
+    if w[0]=="open":
+      flags=DOOR_OPEN
+      w=w[1:]
+    elif w[0]=="close":
+      flags=DOOR_CLOSE
+      w=w[1:]
+    steps=steps+struct.pack("<hHB",int(w[0]),int(w[1]),flags)
+  return struct.pack("<hh",low,high)+steps
+
+#offline analysis of runs in a log file. runs are the lines between
+#Starting and Stopping, their locations are kept in a sidecar index file
+#so that only what was appended since last time needs scanning
+#
+#index file has the log size it covers, then a line per run with offsets
+#of its Starting line and of the end of its Stopping line, critical range
+#and profile name
+# "#size 123456"
+# "4711,29876,183,217,Leaded profile"
+
+INDEXVERSION="#debuglogger index 1"
+# seconds the ramp rates are measured over
+RATE_WINDOW=10.0
+
+def readindex(logfile):
+  runs=[]
+  size=0
+  try:
+    f=open(logfile+".idx")
+  except IOError:
+    return runs,size
+  lines=f.read().split("\n")
+  f.close()
+  if lines[0]!=INDEXVERSION:
+    return [],0
+  for l in lines[1:]:
+    if l.startswith("#size "):
+      size=int(l[6:])
+    elif len(l):
+      w=l.split(",",4)
+      runs.append((int(w[0]),int(w[1]),
+        int(w[2]) if len(w[2]) else None,
+        int(w[3]) if len(w[3]) else None,w[4]))
+  return runs,size
+
+def writeindex(logfile,runs,size):
+  f=open(logfile+".idx","w")
+  f.write(INDEXVERSION+"\n")
+  f.write("#size %d\n"%size)
+  for r in runs:
+    f.write("%d,%d,%s,%s,%s\n"%(r[0],r[1],
+      "" if r[2] is None else r[2],"" if r[3] is None else r[3],r[4]))
+  f.close()
+
+#returns (start,end,lowcritical,highcritical,profile) for each complete
+#run in the log, updating the index for what was added to it
+def indexlog(logfile):
+  runs,size=readindex(logfile)
+  logsize=os.path.getsize(logfile)
+  f=open(logfile)
+  if runs:
+    f.seek(runs[-1][0])
+    if size>logsize or f.readline().rstrip()!="Starting":
+      runs,size=[],0 # log was truncated or replaced
+  # resume after the last run, the part after it may have grown since
+  offset=runs[-1][1] if runs else 0
+  if offset==logsize and size==logsize:
+    f.close()
+    return runs
+  f.seek(offset)
+  start=None
+  low=high=None
+  profile=lastprofile=""
+  for l in f:
+    s=l.rstrip()
+    if s=="Starting":
+      start=offset
+      low=high=None
+      profile=lastprofile
+      lastprofile=""
+    elif s.startswith("#critical ") and start is not None:
+      w=s[10:].split(",")
+      low,high=int(w[0]),int(w[1])
+    elif re.match("#(Leaded|Lead-free|Uploaded) profile",s):
+      lastprofile=s[1:]
+    elif s=="Stopping" and start is not None:
+      runs.append((start,offset+len(l),low,high,profile))
+      start=None
+    offset+=len(l)
+  f.close()
+  writeindex(logfile,runs,offset)
+  return runs
+
+#column names and rows of numbers for a run, rows that do not parse or
+#match the header are skipped
+def runrows(logfile,start,end):
+  f=open(logfile)
+  f.seek(start)
+  text=f.read(end-start)
+  f.close()
+  names=None
+  rows=[]
+  for l in text.split("\n"):
+    if not len(l) or l.startswith("#") or l in ("Starting","Stopping"):
+      continue
+    w=l.split(",")
+    if names is None:
+      names=[x.split("#")[0] for x in w]
+      continue
+    if len(w)!=len(names):
+      continue
+    try:
+      rows.append([float(x) for x in w])
+    except ValueError:
+      pass
+  if names is None:
+    return [],np.zeros((0,0))
+  return names,np.array(rows,dtype=float).reshape(-1,len(names))
+
+#metrics of one run: length, peak, seconds at or above critical range
+#limits, fastest heating and cooling, and overshoot of each step. takes
+#one tuple so that it can be mapped over a process pool
+def runmetrics(job):
+  logfile,start,end,low,high,profile=job
+  names,d=runrows(logfile,start,end)
+  m={"offset":start,"profile":profile}
+  if len(d)<2 or "time" not in names or "temperature" not in names:
+    return m
+  t=d[:,names.index("time")]
+  v=d[:,names.index("temperature")]
+  dt=np.diff(t)
+  m["seconds"]=t[-1]-t[0]
+  m["peak"]=v.max()
+  if low is not None:
+    m["abovelow"]=dt[v[:-1]>=low].sum()
+    m["abovehigh"]=dt[v[:-1]>=high].sum()
+  k=max(1,int(round(RATE_WINDOW/max(np.median(dt),1e-3))))
+  if len(v)>k:
+    rate=(v[k:]-v[:-k])/np.maximum(t[k:]-t[:-k],1e-3)
+    m["maxrise"]=rate.max()
+    m["maxfall"]=rate.min()
+  if "target" in names:
+    target=d[:,names.index("target")]
+    bounds=np.concatenate(([0],np.flatnonzero(np.diff(target))+1,[len(target)]))
+    previous=v[0]
+    steps=[]
+    for a,b in zip(bounds[:-1],bounds[1:]):
+      if target[a]>=previous:
+        over=v[a:b].max()-target[a]
+      else:
+        over=target[a]-v[a:b].min()
+      steps.append((target[a],max(over,0.0)))
+      previous=target[a]
+    m["overshoot"]=steps
+  return m
+
+ANALYSIS_HEADER="run,offset,profile,seconds,peak,abovelow,abovehigh,maxrise,maxfall,overshoot"
+
+def formatmetrics(n,m):
+  def num(key,fmt="%.1f"):
+    return fmt%m[key] if key in m else ""
+  steps=" ".join(["%g:%.1f"%s for s in m.get("overshoot",[])])
+  return ",".join([str(n),str(m["offset"]),m["profile"],num("seconds"),
+    num("peak"),num("abovelow"),num("abovehigh"),num("maxrise","%.2f"),
+    num("maxfall","%.2f"),steps])
+
+def analyze(logfile,jobs):
+  work=[(logfile,)+r for r in indexlog(logfile)]
+  if jobs!=1 and len(work)>1:
+    pool=multiprocessing.Pool(jobs if jobs>1 else None)
+    results=pool.map(runmetrics,work)
+    pool.close()
+  else:
+    results=map(runmetrics,work)
+  print ANALYSIS_HEADER
+  for n,m in enumerate(results,1):
+    print formatmetrics(n,m)
+
+# debuglogger.py -a [-j jobs] [logfile] prints metrics of logged runs, jobs
+# 0 uses all cores
+if len(sys.argv)>1 and sys.argv[1]=="-a":
+  args=sys.argv[2:]
+  jobs=1
+  if len(args)>1 and args[0]=="-j":
+    jobs=int(args[1])
+    args=args[2:]
+  analyze(args[0] if args else LOGFILE,jobs)
+  sys.exit(0)
+
+log=open(LOGFILE,"a")
+ser=serial.Serial(SERIALPORT,38400)
+
+#profile to send when the controller asks for one, given on command line
+uploadprofile=None
+if len(sys.argv)>1:
+  uploadprofile=loadprofile(sys.argv[1])
+
+# rows kept per run, older ones are dropped when a run is longer than this
+RING_ROWS=32768
+# seconds between live chart redraws
+CHART_INTERVAL=1.0
+# seconds to wait for input before servicing the chart window
+IDLE_WAIT=0.05
+
+#run data as one preallocated numpy ring buffer per column, columns and
+#their types come from the "name#format" header
+class RunData:
+  def __init__(self,header,size=RING_ROWS):
+    self.names=[]
+    self.columns=[]
+    self.convert=[]
+    for f in header.split(","):
+      ff=f.split("#")
+      dt=np.dtype(ff[1])
+      self.names.append(ff[0])
+      self.columns.append(np.zeros(size,dtype=dt))
+      self.convert.append(float if dt.kind=='f' else int)
+    self.size=size
+    self.rows=0
+
+  #adds a text row, returns False if it does not match the header
+  def add(self,l):
+    w=l.split(",")
+    if len(w)!=len(self.columns):
+      return False
+    try:
+      v=[c(x) for c,x in zip(self.convert,w)]
+    except ValueError:
+      return False
+    i=self.rows%self.size
+    for c,x in zip(self.columns,v):
+      c[i]=x
+    self.rows=self.rows+1
+    return True
+
+  #column values in arrival order
+  def column(self,n):
+    c=self.columns[n]
+    if self.rows<=self.size:
+      return c[:self.rows]
+    i=self.rows%self.size
+    return np.concatenate((c[i:],c[:i]))
+
+#chart of a run that is redrawn as rows arrive
+class LiveChart:
+  colors=['k-','b-','r-','g-','c-','m-','y-','b:','r:','g:','c:']
+
+  def __init__(self,run):
+    plt.ion()
+    plt.close('all')
+    self.fig,self.ax=plt.subplots()
+    self.lines=[]
+    for f in range(1,len(run.names)):
+      line,=self.ax.plot([],[],self.colors[f%len(self.colors)],label=run.names[f])
+      self.lines.append(line)
+    self.ax.legend(loc="upper left")
+    self.ax.set_xlabel("Time (seconds)")
+    self.ax.grid()
+    self.drawn=0
+
+  def update(self,run):
+    times=run.column(0)
+    for f,line in enumerate(self.lines,1):
+      line.set_data(times,run.column(f))
+    self.ax.relim()
+    self.ax.autoscale_view()
+    self.fig.canvas.draw_idle()
+    self.drawn=time.time()
+    self.events()
+
+  #keep the window responsive between redraws
+  def events(self):
+    plt.pause(0.001)
+
+run=None
+livechart=None
 collecting=0
-rows=0
+rxbuf=""
+
+#returns next text line or decoded frame from rxbuf, None if there is
+#no complete one yet
+def nextrecord():
+  global rxbuf
+  while rxbuf:
+    if rxbuf[0]==FRAMESTART:
+      i=rxbuf.find('\0')
+      if i<0:
+        return None
+      l=decodeframe(rxbuf[1:i])
+      rxbuf=rxbuf[i+1:]
+      return l if l is not None else "#bad frame"
+    n=rxbuf.find('\n')
+    z=rxbuf.find('\0')
+    if z>=0 and (n<0 or z<n): # tail of a frame we did not see the start of
+      rxbuf=rxbuf[z+1:]
+      continue
+    if n<0:
+      return None
+    l=rxbuf[:n+1]
+    rxbuf=rxbuf[n+1:]
+    return l
+  return None
 
+#returns next text line, with binary frames decoded into text rows. reads
+#whatever the port has in one go, and sleeps in select until either the
+#port or keyboard has something
 def collect():
-  l=""
+  global rxbuf
   while True:
-    if ser.in_waiting:
-      c=ser.read()
-      l=l+c
-      if c=='\n':
-        return l
+    l=nextrecord()
+    if l is not None:
+      return l
+    n=ser.in_waiting
+    if n:
+      rxbuf=rxbuf+ser.read(n)
     else:
-      time.sleep(0.1)
+      select.select([ser.fileno(),sys.stdin],[],[],IDLE_WAIT)
+      if livechart is not None:
+        livechart.events()
     c=getch()
     if c!=-1:
       ser.write(c)
-      
+
 while 1:
   l=collect().rstrip();
+  if collecting==1 and run is None and len(l) and not l.startswith("#"):
+    l=header(l)
+    run=RunData(l)
+    livechart=LiveChart(run)
+  elif collecting==1 and run is not None and len(l) and not l.startswith("#"):
+    if run.add(l) and time.time()-livechart.drawn>=CHART_INTERVAL:
+      livechart.update(run)
   print l
   log.write(l+'\n')
   log.flush()
-  if l=="Starting":
-    data=""
+  if l=="#Send profile":
+    if uploadprofile is not None:
+      ser.write(encodeframe(uploadprofile))
+    else:
+      print "#no profile file given on command line"
+  elif l.startswith("#delta "):
+    deltaheader(l[7:])
+  elif l=="Starting":
     collecting=1
-    rows=0
+    run=None
+    binformat=None
+    deltaformat=None
+    lastvalues=None
   elif l=="Stopping":
-    if collecting==1 and rows>2:
-      chart(data)
-    data=""
+    if collecting==1 and run is not None and run.rows>2:
+      livechart.update(run)
     collecting=0
-    rows=0
-  elif collecting==1 and len(l) and not l.startswith("#"):
-    data=data+l+"\n"
-    rows=rows+1
+    run=None
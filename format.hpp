@@ -0,0 +1,160 @@
+/* The MIT License (MIT)
+
+  Copyright (c) 2017 Madis Kaal <mast@nomad.ee>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+#ifndef __format_hpp__
+#define __format_hpp__
+
+#include <stdint.h>
+#include <avr/pgmspace.h>
+
+// powers of ten for digit extraction by subtraction
+static const uint32_t format_pow32[] PROGMEM = {
+  1000000000UL,100000000UL,10000000UL,1000000UL,100000UL,10000UL
+};
+static const uint16_t format_pow16[] PROGMEM = { 1000,100,10 };
+
+// formats numbers into caller's buffer, so that a whole line can be
+// handed to serial port at once. AVR has no divide instruction and
+// library division takes hundreds of cycles, so digits are taken out
+// by subtracting powers of ten, and fractions by multiplying by ten.
+// numbers under 10000 never touch 32 bit arithmetic. output that does
+// not fit in the buffer is dropped, the buffer is always terminated
+//
+class Formatter
+{
+  char *buf;
+  uint8_t len,size;
+
+  // digit of n at given power of ten, n is left with the rest
+  template <typename T> static char Digit(T& n,T p)
+  {
+    char d='0';
+    while (n>=p) {
+      n-=p;
+      d++;
+    }
+    return d;
+  }
+
+public:
+
+  Formatter(char *b,uint8_t bufsize) : buf(b),len(0),size(bufsize)
+  {
+    buf[0]='\0';
+  }
+
+  const char *Data() { return buf; }
+  uint8_t Length() { return len; }
+
+  Formatter& Char(char c)
+  {
+    if (len<size-1) {
+      buf[len++]=c;
+      buf[len]='\0';
+    }
+    return *this;
+  }
+
+  Formatter& Str(const char *s)
+  {
+    while (s && *s)
+      Char(*s++);
+    return *this;
+  }
+
+  Formatter& Unsigned(uint32_t n)
+  {
+    bool lead=true;
+    char d;
+    uint8_t i;
+    if (n>=10000) {
+      for (i=0;i<sizeof(format_pow32)/sizeof(format_pow32[0]);i++) {
+        d=Digit(n,(uint32_t)pgm_read_dword(&format_pow32[i]));
+        if (d!='0' || !lead) {
+          Char(d);
+          lead=false;
+        }
+      }
+    }
+    uint16_t m=n;
+    for (i=0;i<sizeof(format_pow16)/sizeof(format_pow16[0]);i++) {
+      d=Digit(m,(uint16_t)pgm_read_word(&format_pow16[i]));
+      if (d!='0' || !lead) {
+        Char(d);
+        lead=false;
+      }
+    }
+    return Char('0'+m);
+  }
+
+  Formatter& Int(int32_t n)
+  {
+    if (n<0) {
+      Char('-');
+      return Unsigned(0-(uint32_t)n);
+    }
+    return Unsigned(n);
+  }
+
+  // n zero padded to given number of digits, up to 4
+  Formatter& Digits(uint16_t n,uint8_t digits)
+  {
+    for (uint8_t i=4-digits;i<sizeof(format_pow16)/sizeof(format_pow16[0]);i++)
+      Char(Digit(n,(uint16_t)pgm_read_word(&format_pow16[i])));
+    return Char('0'+n);
+  }
+
+  // fixed point value with fracbits fraction bits, truncated to
+  // given number of decimals
+  Formatter& Fixed(int32_t v,uint8_t fracbits,uint8_t decimals=3)
+  {
+    uint32_t mask=((uint32_t)1<<fracbits)-1,u;
+    if (v<0) {
+      Char('-');
+      u=0-(uint32_t)v;
+    }
+    else
+      u=v;
+    Unsigned(u>>fracbits);
+    Char('.');
+    u&=mask;
+    while (decimals--) {
+      u=(u<<3)+(u<<1);
+      Char('0'+(u>>fracbits));
+      u&=mask;
+    }
+    return *this;
+  }
+
+  // float rounded to 3 decimals, done as 16 bit fraction fixed point
+  Formatter& Float(float v)
+  {
+    v+=v<0.0?-0.0005:0.0005;
+    if (v>-32768.0 && v<32768.0)
+      return Fixed((int32_t)(v*65536.0),16);
+    Int((int32_t)v);
+    return Str(".000");
+  }
+
+};
+
+#endif
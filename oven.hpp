@@ -24,35 +24,81 @@
 #define __oven_hpp__
 
 #include <avr/io.h>
+#include "zones.hpp"
 #include "temperaturesensor.hpp"
 #include "servo.hpp"
 #include "settings.hpp"
 
-extern TemperatureSensor sensor;
 extern Servo doorservo;
 
 #define CONVECTION() (PORTD|=_BV(PD7))
 #define NO_CONVECTION() (PORTD&=~_BV(PD7))
-#define HEAT() (PORTD|=_BV(PD6))
-#define NO_HEAT() (PORTD&=~_BV(PD6))
+#define HEAT(z) (ZONE_HEATER_PORT(z)|=ZONE_HEATER_BIT(z))
+#define NO_HEAT(z) (ZONE_HEATER_PORT(z)&=~ZONE_HEATER_BIT(z))
 #define COOL() (PORTD|=_BV(PD5))
 #define NO_COOL() (PORTD&=~_BV(PD5))
 
-class Oven
+// heater modulation modes
+#define HEATER_PWM 0
+#define HEATER_SIGMADELTA 1
+
+// heating element of one zone, switched on and off to get the requested
+// power
+//
+class Heater
 {
 protected:
   volatile uint8_t pwm; // 0..127
   volatile uint8_t pwmcount;
   volatile uint8_t edge;
   bool heater_on;
+  uint8_t modulation;
+  uint8_t minticks;     // minimum heater on and off time
+  uint8_t holdticks;    // ticks heater state must still be held
+  int16_t accumulator;  // sigma-delta error
+  uint8_t zone;
+
+  // sigma-delta modulation, heater is switched on every time the
+  // accumulated requested power makes up a full tick, so the on time is
+  // spread evenly instead of in one block per window. when the heater
+  // is held in a state for minticks the error keeps accumulating, and
+  // is paid back after that
+  void SigmaDelta()
+  {
+    accumulator+=pwm;
+    if (holdticks)
+      holdticks--;
+    else if ((accumulator>=127)!=heater_on) {
+      heater_on=!heater_on;
+      if (minticks)
+        holdticks=minticks-1;
+    }
+    if (heater_on) {
+      HeaterOn();
+      accumulator-=127;
+    }
+    else
+      HeaterOff();
+  }
+
 public:
 
-  Oven()
+  Heater()
   {
     pwm=0;
     edge=0;
     pwmcount=0;
     heater_on=false;
+    modulation=HEATER_PWM;
+    minticks=0;
+    holdticks=0;
+    accumulator=0;
+    zone=0;
+  }
+
+  void SetZone(uint8_t z)
+  {
+    zone=z;
   }
 
   void Reset()
@@ -60,37 +106,36 @@ public:
     pwm=0;
     edge=0;
     pwmcount=0;
-    NO_HEAT();
-    NO_COOL();
-    NO_CONVECTION();
-    doorservo.SetPosition(settings.door_closed_position);
+    heater_on=false;
+    holdticks=0;
+    accumulator=0;
+    NO_HEAT(zone);
   }
 
-  void HeaterOn() { HEAT(); }
-  void HeaterOff() { NO_HEAT(); }
-  void CoolerOn() { COOL(); doorservo.SetPosition(settings.door_open_position); }
-  void CoolerOff() { NO_COOL(); doorservo.SetPosition(settings.door_closed_position); }
-  void ConvectionOn() { CONVECTION(); }
-  void ConvectionOff() { NO_CONVECTION(); }
+  void HeaterOn() { HEAT(zone); }
+  void HeaterOff() { NO_HEAT(zone); }
 
   void SetPWM(uint8_t p)
   {
     pwm=p; 
   }
 
-  float Temperature()
-  {
-    return sensor.Read();
-  }
-  
-  bool IsFaulty()
+  // select HEATER_PWM or HEATER_SIGMADELTA modulation, with heater
+  // minimum on and off time in timer ticks for sigma-delta. as Run()
+  // is called from interrupt handler, this should be done with heater off
+  void SetModulation(uint8_t mode,uint8_t ticks)
   {
-    return !sensor.IsConnected();
+    modulation=mode;
+    minticks=ticks;
   }
 
   // this does pwm
-  virtual void Run()
+  void Run()
   {
+    if (modulation==HEATER_SIGMADELTA) {
+      SigmaDelta();
+      return;
+    }
     if (pwmcount<=edge && edge!=0)
       HeaterOn();
     else
@@ -104,4 +149,125 @@ public:
 
 };
 
+// oven with a heater and thermocouple per zone, and the door, cooling
+// and convection fans they share. zone arguments default to zone 0, so
+// single zone code does not need to know about zones
+//
+template <uint8_t zones> class ZonedOven
+{
+  Heater heaters[zones];
+  TemperatureSensor sensors[zones];
+  volatile uint8_t spizone; // zone SPI read is going on for
+
+public:
+
+  ZonedOven() : spizone(0)
+  {
+    for (uint8_t i=0;i<zones;i++) {
+      heaters[i].SetZone(i);
+      sensors[i].SetZone(i);
+    }
+  }
+
+  void Reset()
+  {
+    for (uint8_t i=0;i<zones;i++)
+      heaters[i].Reset();
+    NO_COOL();
+    NO_CONVECTION();
+    doorservo.SetPosition(settings.door_closed_position);
+  }
+
+  void CoolerOn() { COOL(); doorservo.SetPosition(settings.door_open_position); }
+  void CoolerOff() { NO_COOL(); doorservo.SetPosition(settings.door_closed_position); }
+  void ConvectionOn() { CONVECTION(); }
+  void ConvectionOff() { NO_CONVECTION(); }
+
+  void SetPWM(uint8_t p,uint8_t zone=0)
+  {
+    heaters[zone].SetPWM(p);
+  }
+
+  void SetModulation(uint8_t mode,uint8_t ticks)
+  {
+    for (uint8_t i=0;i<zones;i++)
+      heaters[i].SetModulation(mode,ticks);
+  }
+
+  TemperatureSensor& Sensor(uint8_t zone=0)
+  {
+    return sensors[zone];
+  }
+
+  void SetCompensation(float degc)
+  {
+    for (uint8_t i=0;i<zones;i++)
+      sensors[i].SetCompensation(degc);
+  }
+
+  void SetFilter(uint8_t f)
+  {
+    for (uint8_t i=0;i<zones;i++)
+      sensors[i].SetFilter(f);
+  }
+
+  // read all thermocouples. with SPI hardware this starts the read of
+  // zone 0, and SpiInterrupt() goes on to next zone when it completes
+  void ReadSensors()
+  {
+#if MAX6675_HWSPI
+    if (sensors[spizone].Reading())
+      return;
+    spizone=0;
+    sensors[0].StartRead();
+#else
+    for (uint8_t i=0;i<zones;i++)
+      sensors[i].RawRead();
+#endif
+  }
+
+  // must be called from SPI transfer complete interrupt handler
+  void SpiInterrupt()
+  {
+    sensors[spizone].SpiInterrupt();
+    if (!sensors[spizone].Reading() && spizone+1<zones)
+      sensors[++spizone].StartRead();
+  }
+
+  float Temperature(uint8_t zone=0)
+  {
+    return sensors[zone].Read();
+  }
+
+  int16_t TemperatureQuarters(uint8_t zone=0)
+  {
+    return sensors[zone].ReadQuarters();
+  }
+
+  // rate of temperature change, degc/s
+  float TemperatureRate(uint8_t zone=0)
+  {
+    return sensors[zone].ReadRate();
+  }
+  
+  // faulty if any of the thermocouples is
+  bool IsFaulty()
+  {
+    for (uint8_t i=0;i<zones;i++) {
+      if (!sensors[i].IsConnected())
+        return true;
+    }
+    return false;
+  }
+
+  void Run()
+  {
+    for (uint8_t i=0;i<zones;i++)
+      heaters[i].Run();
+  }
+
+};
+
+typedef ZonedOven<OVEN_ZONES> Oven;
+
 #endif
@@ -25,36 +25,104 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <math.h>
 #include "serial.hpp"
 
+// back-calculation anti-windup tracking gain, the part of output limit
+// overrun taken off the integral per sample. tracking time is
+// sqrt(Ti*Td), or Ti without derivative, but not less than a sample
+static inline float PIDTrackingGain(float kp,float ki,float kd)
+{
+  if (ki<=0.0)
+    return 0.0;
+  float tt=kd>0.0?sqrt(kd/ki):kp/ki;
+  return tt>1.0?1.0/tt:1.0;
+}
+
+// in bumpless mode the integral is kept when setpoint moves, so that
+// profile steps can follow one another without the output collapsing.
+// windup is then limited by back-calculation instead of stopping the
+// integration, derivative is taken from the process value alone so that
+// setpoint jumps do not kick it, and proportional term can act on a
+// weighted setpoint (b*Sp-value) to soften the response to setpoint
+// changes
+//
 class PID
 {
 private:
   int8_t saturation;
   int16_t output;
   float Kp,Ki,Kd;  // coefficents
+  float Kt;        // back-calculation tracking gain
+  float Bw;        // setpoint weight for proportional term
+  bool bumpless;
   float pe;        // previous error
   float integral;  // accumulated integral
   float Sp;        // setpoint value
+  float ps;        // setpoint on previous sample
+
+  // integral has to make up for what setpoint weighting takes off the
+  // proportional term, so its limits move with that
+  float WeightOffset()
+  {
+    return Kp*(1.0-Bw)*Sp;
+  }
+
+  int16_t Compute(float e,float derivative)
+  {
+    float w=WeightOffset(),lo=omin+w,hi=omax+w,u;
+    if (bumpless) {
+      derivative-=Sp-ps;
+      integral+=Ki*e;
+    }
+    else if (saturation*e<=0)
+      integral=integral+Ki*e;
+    if (integral>=lo and integral<=hi)
+      saturation=0;
+    else {
+      if (integral<lo) {
+        integral=lo;
+        saturation=-1;
+      }
+      else {
+        integral=hi;
+        saturation=1;
+      }
+    }
+    pe=e;
+    ps=Sp;
+    u=Kp*e-w+integral+Kd*derivative;
+    output=u;
+    if (output>omax)
+      output=omax;
+    if (output<omin)
+      output=omin;
+    if (bumpless) {
+      integral+=Kt*(output-u);
+      if (integral<lo)
+        integral=lo;
+      if (integral>hi)
+        integral=hi;
+    }
+    return output;
+  }
 
 protected:
   int16_t omin,omax; // output value range
     
 public:
 
-  PID() : saturation(0),output(0.0),
-          pe(0.0),integral(0.0),Sp(0.0),omin(-255),omax(255)
+  PID() : saturation(0),output(0.0),Kp(0.0),Ki(0.0),Kd(0.0),Kt(0.0),
+          Bw(1.0),bumpless(false),
+          pe(0.0),integral(0.0),Sp(0.0),ps(0.0),omin(-255),omax(255)
   {
   }
   
   // initialize controller with coefficents and
   // semi-useful default input and output ranges
-  PID(float kp,float ki,float kd)
+  PID(float kp,float ki,float kd) : PID()
   {
-    PID();
-    Kp=kp;
-    Ki=ki;
-    Kd=kd;
+    SetCoefficents(kp,ki,kd);
   }
 
   // set output value limits
@@ -70,6 +138,23 @@ public:
     Kp=kp;
     Ki=ki;
     Kd=kd;
+    Kt=PIDTrackingGain(kp,ki,kd);
+  }
+
+  void SetBumpless(bool on)
+  {
+    bumpless=on;
+  }
+
+  bool IsBumpless()
+  {
+    return bumpless;
+  }
+
+  // setpoint weight for proportional term, 1 for none
+  void SetSetpointWeight(float b)
+  {
+    Bw=b;
   }
   
   void GetCoefficents(float& kp,float& ki,float& kd)
@@ -79,11 +164,11 @@ public:
     kd=Kd;
   }
 
-  // get a value of currently accumulated integral
-  // (for curiosity and debugging)
+  // get a value of currently accumulated integral, without what it
+  // makes up for setpoint weighting (for curiosity and debugging)
   float GetIntegral()
   {
-    return integral;
+    return integral-WeightOffset();
   }
   
   // adjust setpoint
@@ -98,7 +183,7 @@ public:
   void Reset()
   {
     integral=0;
-    pe=0;
+    pe=0;    ps=Sp; // no setpoint change to differentiate on first sample
   }
   
   // get setpoint value
@@ -118,31 +203,394 @@ public:
   int16_t ProcessInput(float value)
   {
     float e=Sp-value;
-    if (saturation*e<=0)
-      integral=integral+Ki*e;
-    if (integral>=omin and integral<=omax)
+    return Compute(e,e-pe);
+  }
+
+  // same when rate of process value change per sample is known, the
+  // derivative is then taken from it instead of differencing samples
+  int16_t ProcessInput(float value,float rate)
+  {
+    return Compute(Sp-value,(Sp-ps)-rate);
+  }
+
+    
+};
+
+// same controller as PID, in integer arithmetic. AVR has no FPU, and this
+// does with hardware integer multiplies what PID does with software
+// floating point. temperatures and errors are kept in 1/16 degc, Kp and Kd
+// in 1/256 units and Ki in 1/65536 units, so the coefficents are limited
+// to -127.99..127.99 for Kp and Kd and -0.4999..0.4999 for Ki. the
+// integral is in 1/2^20 units to keep the resolution Ki*e has
+//
+class FixedPID
+{
+private:
+  int8_t saturation;
+  int16_t output;
+  int16_t Kp,Ki,Kd;  // coefficents
+  int16_t Kt;        // back-calculation tracking gain (1/256)
+  int16_t Bw;        // setpoint weight (1/256)
+  bool bumpless;
+  int16_t pe;        // previous error (1/16 degc)
+  int32_t integral;  // accumulated integral (1/2^20)
+  int16_t Sp;        // setpoint value (1/16 degc)
+  int16_t ps;        // setpoint on previous sample (1/16 degc)
+
+  // convert float to fixed point with given number of fraction
+  // bits, limiting to int16_t range
+  static int16_t Fixed(float v,uint8_t bits)
+  {
+    v*=(int32_t)1<<bits;
+    if (v>32767.0)
+      return 32767;
+    if (v<-32767.0)
+      return -32767;
+    return (int16_t)(v<0.0?v-0.5:v+0.5);
+  }
+
+  // integral has to make up for what setpoint weighting takes off the
+  // proportional term, so its limits move with that. the offset is in
+  // 1/4096 units, and limited to keep the integral limits in range
+  int32_t WeightOffset()
+  {
+    int32_t w=0;
+    if (Bw!=256) {
+      w=(int32_t)Kp*(((int32_t)(256-Bw)*Sp)>>8);
+      if (w>1024L*4096)
+        w=1024L*4096;
+      if (w<-1024L*4096)
+        w=-1024L*4096;
+    }
+    return w;
+  }
+
+  // derivative in 1/16 degc per sample
+  int16_t Compute(int16_t e,int32_t derivative)
+  {
+    int32_t w=WeightOffset(),lo,hi;
+    lo=((int32_t)omin<<20)+w*256;
+    hi=((int32_t)omax<<20)+w*256;
+    if (bumpless) {
+      derivative-=(int32_t)Sp-ps;
+      integral+=(int32_t)Ki*e;
+    }
+    else if (!(saturation>0 && e>0) && !(saturation<0 && e<0))
+      integral+=(int32_t)Ki*e;
+    if (integral>=lo && integral<=hi)
       saturation=0;
     else {
-      if (integral<omin) {
-        integral=omin;
+      if (integral<lo) {
+        integral=lo;
         saturation=-1;
       }
       else {
-        integral=omax;
+        integral=hi;
         saturation=1;
       }
     }
-    float derivative=e-pe;
     pe=e;
-    output=Kp*e+integral+Kd*derivative;
-    if (output>omax)
-      output=omax;
-    if (output<omin)
-      output=omin;
+    ps=Sp;
+    // sum in 1/4096 units, truncated towards zero like float to int
+    int32_t u=(int32_t)Kp*e-w+(integral>>8)+Kd*derivative;
+    int32_t o=u/4096;
+    if (o>omax)
+      o=omax;
+    if (o<omin)
+      o=omin;
+    output=o;
+    if (bumpless) {
+      // overrun is limited to output range, which is as far as the
+      // integral can move anyway, to keep Kt times it in range
+      int32_t over=o*4096-u,range=((int32_t)omax-omin)*4096;
+      if (over>range)
+        over=range;
+      if (over<-range)
+        over=-range;
+      integral+=(int32_t)Kt*over;
+      if (integral<lo)
+        integral=lo;
+      if (integral>hi)
+        integral=hi;
+    }
     return output;
   }
 
+protected:
+  int16_t omin,omax; // output value range
     
+public:
+
+  FixedPID() : saturation(0),output(0),Kp(0),Ki(0),Kd(0),Kt(0),Bw(256),
+               bumpless(false),
+               pe(0),integral(0),Sp(0),ps(0),omin(-255),omax(255)
+  {
+  }
+  
+  FixedPID(float kp,float ki,float kd) : FixedPID()
+  {
+    SetCoefficents(kp,ki,kd);
+  }
+
+  // set output value limits
+  void SetOutputLimits(int16_t min,int16_t max)
+  {
+    omin=min;
+    omax=max;
+  }
+  
+  // get/set coefficents, conversion to fixed point is done here so
+  // this should not be called more often than once per sample
+  void SetCoefficents(float kp,float ki,float kd)
+  {
+    Kp=Fixed(kp,8);
+    Ki=Fixed(ki,16);
+    Kd=Fixed(kd,8);
+    Kt=Fixed(PIDTrackingGain(kp,ki,kd),8);
+  }
+
+  void SetBumpless(bool on)
+  {
+    bumpless=on;
+  }
+
+  bool IsBumpless()
+  {
+    return bumpless;
+  }
+
+  // setpoint weight for proportional term, 1 for none
+  void SetSetpointWeight(float b)
+  {
+    Bw=Fixed(b,8);
+  }
+  
+  void GetCoefficents(float& kp,float& ki,float& kd)
+  {
+    kp=Kp/256.0;
+    ki=Ki/65536.0;
+    kd=Kd/256.0;
+  }
+
+  // get a value of currently accumulated integral, without what it
+  // makes up for setpoint weighting (for curiosity and debugging)
+  float GetIntegral()
+  {
+    return (integral-WeightOffset()*256)/1048576.0;
+  }
+  
+  // adjust setpoint
+  void SetSetPoint(float sp)
+  {
+    Sp=Fixed(sp,4);
+  }
+
+  // reset error and integral
+  void Reset()
+  {
+    integral=0;
+    pe=0;    ps=Sp;
+  }
+  
+  // get setpoint value
+  float GetSetPoint(void)
+  {
+    return Sp/16.0;
+  }
+
+  // get latest calculated output value
+  int16_t GetOutput(void)
+  {
+    return output;
+  }
+    
+  // process next process value sample
+  // returns calculated controller output
+  int16_t ProcessInput(float value)
+  {
+    return ProcessInput(Fixed(value,4));
+  }
+
+  // same when rate of process value change per sample is known, the
+  // derivative is then taken from it instead of differencing samples
+  int16_t ProcessInput(float value,float rate)
+  {
+    int16_t e=Sp-Fixed(value,4);
+    return Compute(e,(int32_t)Sp-ps-Fixed(rate,4));
+  }
+
+  // same with process value in 1/16 degc
+  int16_t ProcessInput(int16_t value)
+  {
+    int16_t e=Sp-value;
+    return Compute(e,(int32_t)e-pe);
+  }
+
+};
+
+// controller engine is selected at compile time, PIDEngine<true>::type
+// is the fixed point one
+template <bool fixedpoint> struct PIDEngine { typedef PID type; };
+template <> struct PIDEngine<true> { typedef FixedPID type; };
+
+#ifndef PID_FIXEDPOINT
+#define PID_FIXEDPOINT 0
+#endif
+
+// number of gain schedule bands, band 0 is used for the critical
+// temperature range of the profile
+#define GAIN_BANDS 3
+// distance outside a band over which its coefficents are blended in (degc)
+#define GAIN_BLEND 10.0
+
+// PID coefficents for a process value band, band is off when P is 0
+struct GainBand {
+  int16_t low,high; // band range (degc)
+  float P,I,D;
+};
+
+// coefficents by process value band. outside all bands the base ones
+// apply, and within GAIN_BLEND of a band they are blended linearly
+// towards the band ones, so that moving from band to band does not bump
+// the output. lower numbered bands are applied last, so they win where
+// bands overlap
+//
+class GainSchedule
+{
+  GainBand bands[GAIN_BANDS];
+  float P,I,D; // base coefficents
+
+public:
+
+  GainSchedule() : P(0.0),I(0.0),D(0.0)
+  {
+    Clear();
+  }
+
+  void SetBase(float kp,float ki,float kd)
+  {
+    P=kp;
+    I=ki;
+    D=kd;
+  }
+
+  // turn all bands off
+  void Clear()
+  {
+    for (uint8_t i=0;i<GAIN_BANDS;i++) {
+      bands[i].low=bands[i].high=0;
+      bands[i].P=bands[i].I=bands[i].D=0.0;
+    }
+  }
+
+  void SetBand(uint8_t i,const GainBand& band)
+  {
+    if (i<GAIN_BANDS)
+      bands[i]=band;
+  }
+
+  bool Active()
+  {
+    for (uint8_t i=0;i<GAIN_BANDS;i++) {
+      if (bands[i].P!=0.0)
+        return true;
+    }
+    return false;
+  }
+
+  // coefficents at process value v
+  void Coefficents(float v,float& kp,float& ki,float& kd)
+  {
+    float w;
+    kp=P;
+    ki=I;
+    kd=D;
+    for (uint8_t i=GAIN_BANDS;i--;) {
+      const GainBand& b=bands[i];
+      if (b.P==0.0)
+        continue;
+      if (v<b.low)
+        w=1.0-(b.low-v)*(1.0/GAIN_BLEND);
+      else if (v>b.high)
+        w=1.0-(v-b.high)*(1.0/GAIN_BLEND);
+      else
+        w=1.0;
+      if (w<=0.0)
+        continue;
+      kp+=w*(b.P-kp);
+      ki+=w*(b.I-ki);
+      kd+=w*(b.D-kd);
+    }
+  }
+
+};
+
+// controller with coefficents following the process value through a
+// gain schedule. coefficents given with SetCoefficents are the base
+// ones, the schedule updates the controller from them when it has bands
+// and the process value moves them. inside a band or away from all bands
+// they stay the same, and the controller is not touched, for FixedPID
+// that saves float conversions and a sqrt per sample. integral is
+// accumulated as Ki*e, so changing Ki does not move the output
+//
+template <class Controller> class ScheduledPID : public Controller
+{
+  float P,I,D; // coefficents the controller has
+
+  void Apply(float kp,float ki,float kd)
+  {
+    P=kp;
+    I=ki;
+    D=kd;
+    Controller::SetCoefficents(kp,ki,kd);
+  }
+
+  void Schedule(float value)
+  {
+    float kp,ki,kd;
+    if (!schedule.Active())
+      return;
+    schedule.Coefficents(value,kp,ki,kd);
+    if (kp!=P || ki!=I || kd!=D)
+      Apply(kp,ki,kd);
+  }
+
+public:
+
+  GainSchedule schedule;
+
+  ScheduledPID() : P(0.0),I(0.0),D(0.0)
+  {
+  }
+
+  ScheduledPID(float kp,float ki,float kd) : Controller(kp,ki,kd),
+                                             P(kp),I(ki),D(kd)
+  {
+    schedule.SetBase(kp,ki,kd);
+  }
+
+  void SetCoefficents(float kp,float ki,float kd)
+  {
+    schedule.SetBase(kp,ki,kd);
+    Apply(kp,ki,kd);
+  }
+
+  using Controller::ProcessInput;
+
+  int16_t ProcessInput(float value)
+  {
+    Schedule(value);
+    return Controller::ProcessInput(value);
+  }
+
+  int16_t ProcessInput(float value,float rate)
+  {
+    Schedule(value);
+    return Controller::ProcessInput(value,rate);
+  }
+
 };
 
+typedef ScheduledPID<PIDEngine<PID_FIXEDPOINT>::type> PIDController;
+
 #endif
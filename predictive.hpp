@@ -0,0 +1,160 @@
+/* The MIT License (MIT)
+
+  Copyright (c) 2017 Madis Kaal <mast@nomad.ee>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+#ifndef __predictive_hpp__
+#define __predictive_hpp__
+
+#include <stdint.h>
+
+// seconds of setpoint trajectory looked at after the dead time, longer
+// is smoother but makes the oven creep towards targets
+#define MPC_HORIZON 10
+// longest dead time the controller can handle (seconds)
+#define MPC_MAXDEAD 32
+// how fast unmodelled heating or losses are picked up
+#define MPC_ESTIMATOR 0.1
+// the controller settles on targets without overshoot, and as sensor
+// readings are truncated they can stay a bit under. profile steps count
+// the target reached when within this many degrees
+#define MPC_TOLERANCE 0.5
+
+// model predictive controller for an oven that behaves as first order
+// system with dead time. the model is, per one second sample
+//
+//   T(k+1) = T(k) + rate*u(k-dead)/omax - (T(k)-ambient)/tau + w
+//
+// outputs sent during last dead time seconds are remembered, so the
+// temperature the oven will have when the next output starts to show
+// can be predicted. from there the output is chosen as the one that, held
+// constant for MPC_HORIZON seconds, gives least squared error against
+// the setpoint trajectory. this has a closed form solution, so it costs a
+// few floating point operations per horizon second. w is estimated from
+// one step prediction errors to remove steady state offset. the state is
+// 59 bytes of RAM on AVR, 32 of them the output history, so MPC_MAXDEAD
+// is what to cut if RAM runs short
+//
+class PredictiveController
+{
+  float rate;          // heating rate at full output (degc/s)
+  float loss;          // 1/tau
+  float ambient;
+  float disturbance;   // estimated w (degc/s)
+  float predicted;     // temperature predicted for this sample
+  bool started;
+  uint8_t dead;
+  uint8_t history[MPC_MAXDEAD]; // last dead outputs, oldest at hptr
+  uint8_t hptr;
+  int16_t omax;
+  int16_t output;
+
+public:
+
+  PredictiveController() : rate(1.0),loss(0.01),ambient(25.0),dead(0),omax(127)
+  {
+    Reset();
+  }
+
+  // set model, heating rate in degc per second at full output, time
+  // constant of cooling towards ambient temperature, and dead time
+  void SetModel(float fullrate,float tau,uint8_t deadtime,float amb)
+  {
+    rate=fullrate;
+    loss=tau>1.0?1.0/tau:1.0;
+    dead=deadtime<MPC_MAXDEAD?deadtime:MPC_MAXDEAD;
+    ambient=amb;
+  }
+
+  void SetOutputLimit(int16_t max)
+  {
+    omax=max;
+  }
+
+  void Reset()
+  {
+    for (hptr=0;hptr<MPC_MAXDEAD;hptr++)
+      history[hptr]=0;
+    hptr=0;
+    disturbance=0.0;
+    predicted=0.0;
+    started=false;
+    output=0;
+  }
+
+  float GetDisturbance()
+  {
+    return disturbance;
+  }
+
+  int16_t GetOutput()
+  {
+    return output;
+  }
+
+  // process next temperature sample. setpoint moves by increment per
+  // second until it reaches target, and stays there
+  int16_t ProcessInput(float value,float setpoint,float increment,float target)
+  {
+    float g=rate/omax,x,s,e,sp,num,den;
+    uint8_t i;
+    if (started)
+      disturbance+=MPC_ESTIMATOR*(value-predicted);
+    started=true;
+    // temperature when the output chosen now starts to have an effect
+    x=value;
+    for (i=0;i<dead;i++) {
+      x+=g*history[(hptr+i)%dead]-loss*(x-ambient)+disturbance;
+      if (i==0)
+        predicted=x;
+    }
+    // free response and unit step response over horizon
+    s=0.0;
+    num=0.0;
+    den=0.0;
+    sp=setpoint+increment*dead;
+    for (i=0;i<MPC_HORIZON;i++) {
+      x+=disturbance-loss*(x-ambient);
+      s+=g-loss*s;
+      sp+=increment;
+      if ((increment>=0.0 && sp>target) || (increment<0.0 && sp<target))
+        sp=target;
+      e=sp-x;
+      num+=e*s;
+      den+=s*s;
+    }
+    e=den>0.0?num/den:0.0;
+    if (e>omax)
+      e=omax;
+    if (e<0.0)
+      e=0.0;
+    output=(int16_t)(e+0.5);
+    if (dead) {
+      history[hptr]=output;
+      hptr=(hptr+1)%dead;
+    }
+    else
+      predicted=value+g*output-loss*(value-ambient)+disturbance;
+    return output;
+  }
+
+};
+
+#endif
@@ -20,12 +20,17 @@
   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
   SOFTWARE.
 */
+#include <util/crc16.h>
 #include "process.hpp"
 #include "settings.hpp"
+#include "scheduler.hpp"
 
 extern Button startbutton;
 
-PID pidcontroller(10.0,0.0,0.0);
+// one PID controller for each zone, single zone code sees only zone 0
+PIDController pidcontrollers[OVEN_ZONES];
+static PIDController& pidcontroller=pidcontrollers[0];
+PredictiveController predictor;
 
 extern Oven oven;
 
@@ -37,189 +42,607 @@ extern Oven oven;
 // normal heating rate 2 degC/sec
 // normal cooling rate 3 degC/sec
 
-struct ProfileStep leadedsteps[] = {
-  { ProfileStep::DOOR_CLOSE, 0},
-  { 100, 60 }, // heat up to 100, this will lag and overshoot
-  { 120, 30 }, // ride the overshoot to up to 150
-  { 150, 40 }, // get to preheat temperature, still overshooting here
-  { 150, 60 }, // stay at preheat
-  { 185, 30 }, // ramp to reflow
-  { 210, 20 }, // fast towards peak reflow, this will also overshoot
-  { 228, 10 }, // reset controller then take last step
-  { 228, 3 }, // reset controller then take last step
-  { ProfileStep::DOOR_OPEN, 0},
-  { 60, 60  }, // rapid cooldown
-  { ProfileStep::PROCESS_DONE, 0  }  // done
+const ProfileStep leadedsteps[] PROGMEM = {
+  PROFILE_STEP(25,100,60,ProfileStep::DOOR_CLOSE), // heat up to 100, this will lag and overshoot
+  PROFILE_STEP(100,120,30,0), // ride the overshoot to up to 150
+  PROFILE_STEP(120,150,40,0), // get to preheat temperature, still overshooting here
+  PROFILE_STEP(150,150,60,0), // stay at preheat
+  PROFILE_STEP(150,185,30,0), // ramp to reflow
+  PROFILE_STEP(185,210,20,0), // fast towards peak reflow, this will also overshoot
+  PROFILE_STEP(210,228,10,0), // reset controller then take last step
+  PROFILE_STEP(228,228,3,0), // reset controller then take last step
+  PROFILE_STEP(228,60,60,ProfileStep::DOOR_OPEN), // rapid cooldown
+  PROFILE_DONE // done
 };
 
-struct ProfileStep leadfreesteps[] = {
-  { ProfileStep::DOOR_CLOSE,0 },
-  { 100, 60 },
-  { 125, 30 },
-  { 160, 20 },
-  { 180, 30 },
-  { 200,30 }, // preheat, ramp to 200 in 90 seconds
-  { 200,5 }, // hold for 5 seconds
-  { 210,25 }, // ramp up to reflow temp at nominal rate
-  { 235,10 },
-  { 250,10 }, // ramp up to peak reflow at faster rate
-  { 250,4  },  // stay at peak for 4 seconds
-  { ProfileStep::DOOR_OPEN,0 },
-  { 60,60  },  // cool down to 60deg
-  { ProfileStep::PROCESS_DONE, 0   }    // done
+const ProfileStep leadfreesteps[] PROGMEM = {
+  PROFILE_STEP(25,100,60,ProfileStep::DOOR_CLOSE),
+  PROFILE_STEP(100,125,30,0),
+  PROFILE_STEP(125,160,20,0),
+  PROFILE_STEP(160,180,30,0),
+  PROFILE_STEP(180,200,30,0), // preheat, ramp to 200 in 90 seconds
+  PROFILE_STEP(200,200,5,0), // hold for 5 seconds
+  PROFILE_STEP(200,210,25,0), // ramp up to reflow temp at nominal rate
+  PROFILE_STEP(210,235,10,0),
+  PROFILE_STEP(235,250,10,0), // ramp up to peak reflow at faster rate
+  PROFILE_STEP(250,250,4,0), // stay at peak for 4 seconds
+  PROFILE_STEP(250,60,60,ProfileStep::DOOR_OPEN), // cool down to 60deg
+  PROFILE_DONE // done
 };
 
-struct Profile leadedprofile = {
+const struct Profile leadedprofile PROGMEM = {
   &leadedsteps[0],
   160,
   200
 };
 
-struct Profile leadfreeprofile = {
+const struct Profile leadfreeprofile PROGMEM = {
   &leadfreesteps[0],
   190,
   215
 };
 
-void Process::SetProfile(Profile *p)
+StoredProfile EEMEM ee_profiles[PROFILE_SLOTS];
+RunRecord EEMEM ee_runlog[RUNLOG_SIZE];
+GainBand EEMEM ee_gainbands[GAIN_BANDS];
+
+// CRC of stored profile slot, over everything before crc field
+static uint16_t StoredProfileCRC(uint8_t slot)
 {
-  profile=p;
-  step=&p->steps[0];
-  while (1) {
-    if (step->temp==ProfileStep::PROCESS_DONE) {
-      state=STOPPING;
-      serial.print("#no steps in process?\n");
-      return;
-    }
-    if (step->temp==ProfileStep::DOOR_OPEN) {
-      oven.CoolerOn();
-      serial.print("#opening door\n");
-      step++;
-      continue;
-    }
-    if (step->temp==ProfileStep::DOOR_CLOSE) {
-      oven.CoolerOff();
-      serial.print("#closing door\n");
-      step++;
-      continue;
-    }
-    if (step->temp>0)
-      break;
-    step++; // safeguard for special steps not handled here
+  const uint8_t *p=(const uint8_t*)&ee_profiles[slot];
+  uint16_t crc=0;
+  for (uint8_t i=0;i<offsetof(StoredProfile,crc);i++)
+    crc=_crc_xmodem_update(crc,eeprom_read_byte(p+i));
+  return crc;
+}
+
+// returns number of steps in stored profile and its critical range,
+// 0 if the slot is empty or corrupted
+uint8_t Process::StoredProfileSteps(uint8_t slot,int16_t& low,int16_t& high)
+{
+  if (slot>=PROFILE_SLOTS)
+    return 0;
+  uint8_t n=eeprom_read_byte(&ee_profiles[slot].stepcount);
+  if (n==0 || n>PROFILE_MAXSTEPS ||
+      StoredProfileCRC(slot)!=eeprom_read_word(&ee_profiles[slot].crc))
+    return 0;
+  low=eeprom_read_word((const uint16_t*)&ee_profiles[slot].lowcritical);
+  high=eeprom_read_word((const uint16_t*)&ee_profiles[slot].highcritical);
+  return n;
+}
+
+// stores uploaded profile in EEPROM slot, the setpoint increments are
+// computed here the same way PROFILE_STEP does. returns false if the
+// profile data does not make sense, or if something is running, as the
+// running profile may be reading its steps from the slot
+bool Process::StoreProfile(uint8_t slot,const uint8_t *data,uint8_t len)
+{
+  StoredProfile *ep=&ee_profiles[slot];
+  ProfileStep s;
+  int16_t from=PROFILE_START_TEMP;
+  int32_t increment;
+  uint8_t n=(len-PROFILE_UPLOAD_HEADER)/PROFILE_UPLOAD_STEP;
+  if (state!=STOPPED || slot>=PROFILE_SLOTS ||
+      len<PROFILE_UPLOAD_HEADER+PROFILE_UPLOAD_STEP || len>PROFILE_UPLOAD_MAX ||
+      (len-PROFILE_UPLOAD_HEADER)%PROFILE_UPLOAD_STEP)
+    return false;
+  eeprom_update_byte(&ep->stepcount,0); // invalid until complete
+  eeprom_update_word((uint16_t*)&ep->lowcritical,data[0]|(data[1]<<8));
+  eeprom_update_word((uint16_t*)&ep->highcritical,data[2]|(data[3]<<8));
+  data+=PROFILE_UPLOAD_HEADER;
+  for (uint8_t i=0;i<n;i++) {
+    s.temp=data[0]|(data[1]<<8);
+    s.seconds=data[2]|(data[3]<<8);
+    s.flags=data[4]&(ProfileStep::DOOR_OPEN|ProfileStep::DOOR_CLOSE);
+    if (s.temp<=0 || s.temp>1000)
+      return false;
+    // too steep a ramp would not fit the increment
+    increment=((int32_t)s.temp-from)*256/(s.seconds?s.seconds:1);
+    if (increment>32767 || increment<-32768)
+      return false;
+    s.increment=increment;
+    if (s.temp<from)
+      s.flags|=ProfileStep::DOWN;
+    from=s.temp;
+    eeprom_update_block(&s,&ep->steps[i],sizeof(s));
+    data+=PROFILE_UPLOAD_STEP;
   }
-  targettemp=step->temp;
-  setpoint=oven.Temperature();
-  if (step->seconds==0)
-    setpointstep=targettemp-setpoint;
+  s.temp=0;
+  s.seconds=0;
+  s.increment=0;
+  s.flags=ProfileStep::PROCESS_DONE;
+  eeprom_update_block(&s,&ep->steps[n],sizeof(s));
+  eeprom_update_byte(&ep->stepcount,n);
+  eeprom_update_word(&ep->crc,StoredProfileCRC(slot));
+  return true;
+}
+
+// profile setpoint goes to all zones, shifted by zone offsets
+static void SetZoneSetPoints(float sp)
+{
+  pidcontroller.SetSetPoint(sp);
+  for (uint8_t z=1;z<OVEN_ZONES;z++)
+    pidcontrollers[z].SetSetPoint(sp+settings.zone_offset[z]);
+}
+
+// copies profile step from flash or EEPROM
+void Process::ReadStep(const ProfileStep *from,ProfileStep& to)
+{
+  if (stepsineeprom)
+    eeprom_read_block(&to,from,sizeof(to));
   else
-    setpointstep=(targettemp-setpoint)/step->seconds;
-  pidcontroller.SetSetPoint(setpoint);
-  pidcontroller.Reset();
+    memcpy_P(&to,from,sizeof(to));
+}
+
+// moves to next profile step, doing the door actions on the way.
+// returns false if there are no more steps
+bool Process::NextStep()
+{
+  ReadStep(nextstep,step);
+  if (step.flags&ProfileStep::PROCESS_DONE)
+    return false;
+  nextstep++;
+  // feed-forward lead looks into the following step
+  ReadStep(nextstep,following);
+  if (step.flags&ProfileStep::DOOR_OPEN) {
+    oven.CoolerOn();
+    serial.print(FSTR("#opening door\n"));
+  }
+  if (step.flags&ProfileStep::DOOR_CLOSE) {
+    oven.CoolerOff();
+    serial.print(FSTR("#closing door\n"));
+  }
+  targettemp=step.temp;
   runningtime=0;
+  if (!pidcontroller.IsBumpless()) {
+    for (uint8_t z=0;z<OVEN_ZONES;z++)
+      pidcontrollers[z].Reset();
+  }
+  return true;
+}
+
+// true when all zones have reached the step target, shifted by the zone
+// offset. v is zone 0 temperature
+bool Process::TargetReached(float v,float tolerance)
+{
+  for (uint8_t z=0;z<OVEN_ZONES;z++) {
+    float t=targettemp;
+    if (z) {
+      v=oven.Temperature(z);
+      t+=settings.zone_offset[z];
+    }
+    if ((step.flags&ProfileStep::DOWN)?v>t+tolerance:v<t-tolerance)
+      return false;
+  }
+  return true;
+}
+
+// use built-in profile
+void Process::SetProfile(const Profile *p)
+{
+  memcpy_P(&profile,p,sizeof(profile));
+  stepsineeprom=false;
+  BeginProfile();
+}
+
+// use uploaded profile from EEPROM, returns false if there is none
+// in the slot
+bool Process::SetStoredProfile(uint8_t slot)
+{
+  if (!StoredProfileSteps(slot,profile.lowcritical,profile.highcritical)) {
+    serial.print(FSTR("#no valid profile in slot "),(int32_t)slot+1);
+    return false;
+  }
+  serial.print(FSTR("#Uploaded profile "),(int32_t)slot+1);
+  profile.steps=ee_profiles[slot].steps;
+  stepsineeprom=true;
+  BeginProfile();
+  return true;
+}
+
+void Process::BeginProfile()
+{
+  nextstep=profile.steps;
+  if (!NextStep()) {
+    state=STOPPING;
+    serial.print(FSTR("#no steps in process?\n"));
+    return;
+  }
+  setpoint=(int32_t)(oven.Temperature()*256.0);
+  SetZoneSetPoints(setpoint/256.0);
+  // after the setpoint, so that the first sample has no setpoint step
+  for (uint8_t z=0;z<OVEN_ZONES;z++)
+    pidcontrollers[z].Reset();
+}
+
+// PID output limits, coefficents and step transition mode from settings,
+// the same for all zones. back-calculation needs the limits the heater
+// really has, negative output does not cool. profile runs move them by
+// the feed-forward output in LimitPID()
+static void SetupPID()
+{
+  bool bumpless=(settings.step_transition==STEP_BUMPLESS);
+  for (uint8_t z=0;z<OVEN_ZONES;z++) {
+    PIDController& pid=pidcontrollers[z];
+    pid.SetOutputLimits(bumpless?0:-127,127);
+    pid.SetCoefficents(settings.P,settings.I,settings.D);
+    pid.SetBumpless(bumpless);
+    pid.SetSetpointWeight(bumpless?settings.setpoint_weight:1.0);
+  }
+}
+
+// heater saturates where PID output plus feed-forward leaves 0..127,
+// back-calculation of bumpless mode needs the limits moved by ff
+static void LimitPID(PIDController& pid,int16_t ff)
+{
+  if (pid.IsBumpless())
+    pid.SetOutputLimits(-ff,127-ff);
+}
+
+// heater power for controller output
+static uint8_t HeaterPower(int16_t out)
+{
+  if (out>=127)
+    return 127;
+  if (out>=0)
+    return out;
+  return 0;
+}
+
+// set up PID gain schedule for the profile, critical range band gets
+// its limits from the profile
+void Process::LoadGainSchedule()
+{
+  GainBand b;
+  for (uint8_t i=0;i<GAIN_BANDS;i++) {
+    eeprom_read_block(&b,&ee_gainbands[i],sizeof(b));
+    if (i==0) {
+      b.low=profile.lowcritical;
+      b.high=profile.highcritical;
+    }
+    for (uint8_t z=0;z<OVEN_ZONES;z++)
+      pidcontrollers[z].schedule.SetBand(i,b);
+  }
+}
+
+// heater output needed to make the oven follow the setpoint ramp. the
+// ramp rate is taken fflead seconds ahead to make up for the time heat
+// takes to reach the thermocouple, so near the end of a ramp it is
+// already that of the following step. the following step is assumed to
+// start on time, there is nothing to look ahead to while a step holds
+// waiting for the oven. steep ramps and cooling steps are limited to the
+// heater output range, that is also what fits in telemetry record
+int16_t Process::FeedForward()
+{
+  uint32_t ahead=(uint32_t)runningtime+fflead;
+  int16_t increment=0;
+  if (runningtime>=step.seconds)
+    return 0;
+  if (ahead<step.seconds) {
+    if (setpoint!=((int32_t)targettemp<<8))
+      increment=step.increment;
+  }
+  else if (ahead-step.seconds<following.seconds &&
+           !(following.flags&ProfileStep::PROCESS_DONE))
+    increment=following.increment;
+  int32_t ff=((int32_t)ffgain*increment)>>16;
+  if (ff>127)
+    return 127;
+  if (ff<-127)
+    return -127;
+  return ff;
 }
 
 void Process::ProcessTick()
 {
   float v=oven.Temperature();
-  if (step->seconds>runningtime) { // minimum time not expired yet
-    setpoint+=setpointstep;
-    pidcontroller.SetSetPoint(setpoint);
+  int32_t target=(int32_t)targettemp<<8;
+  if (step.seconds>runningtime) { // minimum time not expired yet
+    setpoint+=step.increment;
+    // setpoint may start off from where profile expected it to, do
+    // not ramp past the target then
+    if ((step.increment>0 && setpoint>target) ||
+        (step.increment<0 && setpoint<target))
+      setpoint=target;
+    SetZoneSetPoints(setpoint/256.0);
   }
   else {
-    pidcontroller.SetSetPoint(targettemp);
-    setpoint=targettemp;
-    if (setpointstep>=0.0) { // ramping upwards
-      if (v>=targettemp) {
-        while (1) {
-          step++;
-          if (step->temp==ProfileStep::PROCESS_DONE) {
-            state=STOPPING;
-            serial.print("#last step reached\n");
-            return;
-          }
-          if (step->temp==ProfileStep::DOOR_OPEN) {
-            oven.CoolerOn();
-            serial.print("#opening door\n");
-            continue;
-          }
-          if (step->temp==ProfileStep::DOOR_CLOSE) {
-            oven.CoolerOff();
-            serial.print("#closing door\n");
-            continue;
-          }
-          if (step->temp>0)
-            break;
-        }
-        if (step->temp==targettemp)
-          setpointstep=0.0;
-        else {
-          targettemp=step->temp;
-          if (step->seconds)
-            setpointstep=(targettemp-v)/step->seconds;
-          else
-            setpointstep=(targettemp-v);
-        }
-        runningtime=0;
-        pidcontroller.Reset();
-      } 
-    }
-    else { // ramping downwards or steady
-      if (v<=targettemp) {
-        while (1) {
-          step++;
-          if (step->temp==ProfileStep::PROCESS_DONE) {
-            state=STOPPING;
-            serial.print("#last step reached\n");
-            return;
-          }
-          if (step->temp==ProfileStep::DOOR_OPEN) {
-            oven.CoolerOn();
-            serial.print("#opening door\n");
-            continue;
-          }
-          if (step->temp==ProfileStep::DOOR_CLOSE) {
-            oven.CoolerOff();
-            serial.print("#closing door\n");
-            continue;
-          }
-          if (step->temp>0)
-            break;
-        }
-        if (step->temp==targettemp)
-          setpointstep=0.0;
-        else {
-          targettemp=step->temp;
-          if (step->seconds)
-            setpointstep=(targettemp-v)/step->seconds;
-          else
-            setpointstep=targettemp-v;
-        }
-        runningtime=0;
-        pidcontroller.Reset();
+    SetZoneSetPoints(targettemp);
+    setpoint=target;
+    if (TargetReached(v,predictive?MPC_TOLERANCE:0.0)) {
+      if (!NextStep()) {
+        state=STOPPING;
+        runlog.End(RunRecord::COMPLETE);
+        serial.print(FSTR("#last step reached\n"));
+        return;
       }
     }
   }
   runningtime++;
 }
 
+// zones 1.. are always on PID, with the feed-forward of zone 0
+void Process::RunZones()
+{
+  if (OVEN_ZONES<2)
+    return;
+  int16_t ff=FeedForward();
+  for (uint8_t z=1;z<OVEN_ZONES;z++) {
+    float v=oven.Temperature(z);
+    LimitPID(pidcontrollers[z],ff);
+    if (settings.sensor_filter==SENSOR_ALPHABETA)
+      zoneoutput[z]=pidcontrollers[z].ProcessInput(v,oven.TemperatureRate(z));
+    else
+      zoneoutput[z]=pidcontrollers[z].ProcessInput(v);
+    oven.SetPWM(HeaterPower(zoneoutput[z]+ff),z);
+  }
+}
+
+// sends one telemetry record in format chosen in settings, returns false
+// if there was no room for it in serial transmit buffer
+bool Process::SendTelemetry(float v)
+{
+  float lo=v,hi=v;
+  if (!decimator.Empty()) {
+    lo=decimator.Min();
+    hi=decimator.Max();
+  }
+  if (settings.telemetry!=TELEMETRY_TEXT) {
+    TelemetryRecord r;
+    r.Set(telemetryticks,targettemp,setpoint/256.0,v,pidoutput,
+      predictive?predictor.GetDisturbance():pidcontroller.GetIntegral(),
+      ffoutput,lo,hi);
+    for (uint8_t z=1;z<OVEN_ZONES;z++)
+      r.SetZone(z,oven.Temperature(z),zoneoutput[z]);
+    if (settings.telemetry==TELEMETRY_DELTA)
+      return encoder.Send(r);
+    return r.Send();
+  }
+  // line is formatted first and only sent if it fits in full
+  char buf[TELEMETRY_MAXLINE];
+  Formatter f(buf,sizeof buf);
+  f.Unsigned(telemetryseconds).Char('.');
+  f.Digits(telemetryfraction*(1000/TICKS_PER_SECOND),3).Char(',');
+  f.Fixed(targettemp,0).Char(',');
+  f.Fixed(setpoint,8).Char(',');
+  f.Fixed((int32_t)(v*4.0),2).Char(',');
+  f.Int(pidoutput).Char(',');
+  f.Int(ffoutput).Char(',');
+  f.Fixed((int32_t)(lo*4.0),2).Char(',');
+  f.Fixed((int32_t)(hi*4.0),2);
+  for (uint8_t z=1;z<OVEN_ZONES;z++) {
+    f.Char(',').Fixed(oven.TemperatureQuarters(z),2).Char(',');
+    f.Int(zoneoutput[z]);
+  }
+  f.Char('\n');
+  if (serial.txfree()<f.Length())
+    return false;
+  serial.write(f);
+  return true;
+}
+
+void Process::StartTelemetry()
+{
+  float t=settings.telemetry_interval*TICKS_PER_SECOND;
+  // faster than sensor reads would only repeat the same values
+  if (t<SENSOR_INTERVAL)
+    t=SENSOR_INTERVAL;
+  if (t>0xffff)
+    t=0xffff;
+  telemetryinterval=t;
+  telemetrycountdown=telemetryinterval;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    lasttick=tick_counter;
+  }
+  telemetryticks=0;
+  telemetryseconds=0;
+  telemetryfraction=0;
+  decimator.Clear();
+  encoder.Reset();
+}
+
+// called on every pass while running. temperature is sampled for the
+// decimated values, and a record sent when telemetry interval is up
+void Process::Telemetry()
+{
+  uint16_t now,elapsed;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    now=tick_counter;
+  }
+  elapsed=now-lasttick;
+  lasttick=now;
+  decimator.Add(oven.TemperatureQuarters());
+  telemetryticks+=elapsed;
+  telemetryfraction+=elapsed;
+  while (telemetryfraction>=TICKS_PER_SECOND) {
+    telemetryfraction-=TICKS_PER_SECOND;
+    telemetryseconds++;
+  }
+  if (elapsed<telemetrycountdown) {
+    telemetrycountdown-=elapsed;
+    return;
+  }
+  telemetrycountdown=telemetryinterval;
+  if (droppedlines && serial.txfree()>=TELEMETRY_MAXLINE) {
+    serial.print(FSTR("#dropped lines: "),(int32_t)droppedlines);
+    droppedlines=0;
+  }
+  if (!SendTelemetry(decimator.Mean()))
+    droppedlines++;
+  decimator.Clear();
+}
+
+// manual mode telemetry, binary or text
+void Process::ManualTick(float v)
+{
+  if (settings.sensor_filter==SENSOR_ALPHABETA)
+    pidoutput=pidcontroller.ProcessInput(v,oven.TemperatureRate());
+  else
+    pidoutput=pidcontroller.ProcessInput(v);
+  oven.SetPWM(pidoutput>=0?pidoutput:0);
+  for (uint8_t z=1;z<OVEN_ZONES;z++) {
+    float zv=oven.Temperature(z);
+    if (settings.sensor_filter==SENSOR_ALPHABETA)
+      zoneoutput[z]=pidcontrollers[z].ProcessInput(zv,oven.TemperatureRate(z));
+    else
+      zoneoutput[z]=pidcontrollers[z].ProcessInput(zv);
+    oven.SetPWM(HeaterPower(zoneoutput[z]),z);
+  }
+  if (settings.telemetry!=TELEMETRY_TEXT) {
+    TelemetryRecord r;
+    for (uint8_t z=1;z<OVEN_ZONES;z++)
+      r.SetZone(z,oven.Temperature(z),zoneoutput[z]);
+    r.Send(second_counter*TICKS_PER_SECOND,pidcontroller.GetSetPoint(),
+      pidcontroller.GetSetPoint(),v,pidoutput,pidcontroller.GetIntegral(),0);
+    return;
+  }
+  char buf[TELEMETRY_MAXLINE];
+  Formatter f(buf,sizeof buf);
+  f.Int(second_counter).Char(',');
+  f.Float(pidcontroller.GetSetPoint()).Char(',');
+  f.Fixed((int32_t)(v*4.0),2).Char(',');
+  f.Int(pidoutput).Char(',');
+  f.Float(pidcontroller.GetIntegral());
+  for (uint8_t z=1;z<OVEN_ZONES;z++) {
+    f.Char(',').Fixed(oven.TemperatureQuarters(z),2).Char(',');
+    f.Int(zoneoutput[z]);
+  }
+  f.Char('\n');
+  if (serial.txfree()>=f.Length())
+    serial.write(f);
+}
+
+// one second of relay autotune experiment, the results are saved to
+// settings when it completes
+void Process::TuneTick(float v)
+{
+  if (second_counter>AUTOTUNE_TIMEOUT || v>tunesetpoint+AUTOTUNE_OVERSHOOT) {
+    serial.print(FSTR("#Autotune failed\n"));
+    state=STOPPING;
+    return;
+  }
+  pidoutput=tuner.Sample(second_counter,v);
+  oven.SetPWM(pidoutput);
+  if (tuner.Done()) {
+    oven.Reset();
+    if (tuner.UltimateGain()>0.0) {
+      serial.print(FSTR("#amplitude: "),tuner.Amplitude());
+      serial.print(FSTR("#period: "),tuner.Period());
+      serial.print(FSTR("#ultimate gain: "),tuner.UltimateGain());
+      tuner.Coefficents(tunerule,settings.P,settings.I,settings.D);
+      WriteSettings();
+      ReadSettings();
+    }
+    else
+      serial.print(FSTR("#Autotune failed\n"));
+    state=STOPPING;
+    return;
+  }
+  char buf[TELEMETRY_MAXLINE];
+  Formatter f(buf,sizeof buf);
+  f.Int(second_counter).Char(',');
+  f.Float(tunesetpoint).Char(',');
+  f.Fixed((int32_t)(v*4.0),2).Char(',');
+  f.Int(pidoutput).Char('\n');
+  if (serial.txfree()>=f.Length())
+    serial.write(f);
+}
+
+// common start for manual mode and autotune
+void Process::StartSession()
+{
+  oven.Reset();
+  second_counter=0;
+  timestamp=-1;
+  serial.print(FSTR("\nStarting\n"));
+}
+
+bool Process::Manual(float sp)
+{
+  if (state!=STOPPED)
+    return false;
+  SetupPID();
+  SetZoneSetPoints(sp);
+  for (uint8_t z=0;z<OVEN_ZONES;z++) {
+    pidcontrollers[z].schedule.Clear();
+    pidcontrollers[z].Reset();
+  }
+  StartSession();
+  if (settings.telemetry!=TELEMETRY_TEXT)
+    serial.print(FSTR(TELEMETRY_HEADER));
+  else
+    serial.print(FSTR("time#i4,sepoint#f4,temperature#f4,output#i4,integrator#f4"
+      TELEMETRY_ZONE_TEXT_HEADER "\n"));
+  state=MANUAL;
+  return true;
+}
+
+bool Process::Autotune(float sp,RelayTuner::RULE rule)
+{
+  if (state!=STOPPED)
+    return false;
+  tuner.Start(sp,AUTOTUNE_HYSTERESIS,127,0);
+  tunerule=rule;
+  tunesetpoint=sp;
+  StartSession();
+  serial.print(FSTR("time#i4,setpoint#f4,temperature#f4,output#i4\n"));
+  state=TUNING;
+  return true;
+}
+
+void Process::Stop()
+{
+  if (state==RUNNING || state==MANUAL || state==TUNING)
+    state=STOPPING;
+}
+
+// coefficents entered during a profile or manual run take effect on the
+// next sample, others pick the settings up when they start. the gain
+// schedule keeps its bands and blends towards the new base coefficents
+void Process::UpdatePID()
+{
+  if (state!=RUNNING && state!=MANUAL)
+    return;
+  for (uint8_t z=0;z<OVEN_ZONES;z++)
+    pidcontrollers[z].SetCoefficents(settings.P,settings.I,settings.D);
+}
+
 Process::Process()
 {
   state=STOPPING;
-  timestamp=(unsigned int)-1;
+  timestamp=-1;
   pidoutput=0;
-  profile=NULL;
+  for (uint8_t z=0;z<OVEN_ZONES;z++)
+    zoneoutput[z]=0;
+  ffoutput=0;
+  ffgain=0;
+  fflead=0;
+  predictive=false;
+  tunerule=RelayTuner::ZIEGLER_NICHOLS;
+  tunesetpoint=0.0;
+  nextstep=NULL;
+  stepsineeprom=false;
   pwmcounter=0;
-  targettemp=0.0;
-  setpointstep=0.0;
-  setpoint=0.0;
+  targettemp=0;
+  setpoint=0;
+  runningtime=0;
+  droppedlines=0;
+  telemetryinterval=TICKS_PER_SECOND;
+  telemetrycountdown=telemetryinterval;
+  lasttick=0;
+  telemetryticks=0;
+  telemetryseconds=0;
+  telemetryfraction=0;
 }
 
 void Process::Run()
 {
   float v;
+  uint8_t id;
   switch (state) {
     case STOPPING:
-      serial.print("Stopping\n");
+      runlog.End(RunRecord::ABORTED);
+      serial.print(FSTR("Stopping\n"));
       oven.Reset();
       startbutton.Clear();
       state=STOPPED;
@@ -237,21 +660,55 @@ void Process::Run()
         state=STARTING;
       break;
     case STARTING:
-      pidcontroller.SetOutputLimits(-127,127);
-      pidcontroller.SetCoefficents(settings.P,settings.I,settings.D);
-      if (profilebutton.Pressed()) {
-        serial.print("#Lead-free profile\n");
+      SetupPID();
+      // more than full output per degc/s would not fit ffgain
+      if (settings.FF>127.0)
+        ffgain=127*256;
+      else if (settings.FF<0.0)
+        ffgain=0;
+      else
+        ffgain=settings.FF*256.0;
+      fflead=settings.FFlead;
+      predictive=(settings.controller==CONTROLLER_PREDICTIVE);
+      predictor.SetModel(settings.model_rate,settings.model_tau,
+        settings.model_deadtime,oven.Temperature());
+      predictor.Reset();
+      if (predictive)
+        serial.print(FSTR("#Predictive control\n"));
+      if (settings.profile && SetStoredProfile(settings.profile-1)) {
+        id=settings.profile+1;
+        SHOWPROFILE0();
+      }
+      else if (profilebutton.Pressed()) {
+        serial.print(FSTR("#Lead-free profile\n"));
         SetProfile(&leadfreeprofile);
+        id=1;
         SHOWPROFILE1();
       }
       else {
-        serial.print("#Leaded profile\n");
+        serial.print(FSTR("#Leaded profile\n"));
         SetProfile(&leadedprofile);
+        id=0;
         SHOWPROFILE0();
       }
-      serial.print("Starting\n");
-      serial.print("time#i4,target#f4,setpoint#f4,temperature#f4,pidoutput#i4\n");
+      LoadGainSchedule();
+      runlog.Begin(id,profile.lowcritical,profile.highcritical,predictive);
+      serial.print(FSTR("Starting\n"));
+      serial.print(FSTR("#critical "));
+      serial.print((int32_t)profile.lowcritical);
+      serial.send(',');
+      serial.print((int32_t)profile.highcritical);
+      serial.send('\n');
+      if (settings.telemetry==TELEMETRY_TEXT)
+        serial.print(FSTR("time#f4,target#f4,setpoint#f4,temperature#f4,pidoutput#i4,feedforward#i4,tmin#f4,tmax#f4"
+          TELEMETRY_ZONE_TEXT_HEADER "\n"));
+      else {
+        serial.print(FSTR(TELEMETRY_HEADER));
+        if (settings.telemetry==TELEMETRY_DELTA)
+          serial.print(FSTR(TELEMETRY_DELTA_HEADER));
+      }
       second_counter=0;
+      StartTelemetry();
       oven.ConvectionOn();
       oven.CoolerOff();
       state=RUNNING;
@@ -265,30 +722,50 @@ void Process::Run()
       if (startbutton.Read())
         state=STOPPING;
       //
-      if (timestamp!=second_counter && targettemp>=0.0) {
+      if (timestamp!=second_counter && targettemp>=0) {
         v=oven.Temperature();
-        pidoutput=pidcontroller.ProcessInput(v);
-        if (pidoutput>=0) {
-          oven.SetPWM(pidoutput);
+        if (predictive) {
+          // the model already knows where the setpoint is going
+          pidoutput=predictor.ProcessInput(v,setpoint/256.0,
+            step.increment/256.0,targettemp);
+          ffoutput=0;
         }
         else {
-          oven.SetPWM(0);
+          ffoutput=FeedForward();
+          LimitPID(pidcontroller,ffoutput);
+          if (settings.sensor_filter==SENSOR_ALPHABETA)
+            pidoutput=pidcontroller.ProcessInput(v,oven.TemperatureRate());
+          else
+            pidoutput=pidcontroller.ProcessInput(v);
         }
+        oven.SetPWM(HeaterPower(pidoutput+ffoutput));
+        RunZones();
+        runlog.Sample(v,oven.TemperatureRate());
         ProcessTick();
-        serial.print(second_counter);
-        serial.send(',');
-        serial.print(targettemp);
-        serial.send(',');
-        serial.print(setpoint);
-        serial.send(',');
-        serial.print(v);
-        serial.send(',');
-        serial.print((int32_t)pidoutput);
-        serial.send('\n');
+      }
+      Telemetry();
+      break;
+    case MANUAL:
+    case TUNING:
+      if (oven.IsFaulty()) {
+        state=FAULT;
+        break;
+      }
+      if (startbutton.Read()) {
+        state=STOPPING;
+        break;
+      }
+      if (timestamp!=second_counter) {
+        v=oven.Temperature();
+        if (state==MANUAL)
+          ManualTick(v);
+        else
+          TuneTick(v);
       }
       break;
     case FAULT:
-      serial.print("#Fault\n");
+      runlog.End(RunRecord::FAULT);
+      serial.print(FSTR("#Fault\n"));
       oven.Reset();
       state=BLINKING;
       break;
@@ -298,7 +775,7 @@ void Process::Run()
       }
       if (!oven.IsFaulty())
       {
-        serial.print("#Fault cleared\n");
+        serial.print(FSTR("#Fault cleared\n"));
         state=STOPPING;
       }
       break;      
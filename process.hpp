@@ -24,48 +24,149 @@
 #define __process_hpp__
 
 #include <avr/io.h>
+#include <avr/pgmspace.h>
+#include <avr/eeprom.h>
+#include <stddef.h>
 #include "oven.hpp"
 #include "pid.hpp"
+#include "predictive.hpp"
 #include "serial.hpp"
 #include "button.hpp"
+#include "telemetry.hpp"
+#include "autotune.hpp"
+#include "runlog.hpp"
 
 extern Button profilebutton;
 extern Button startbutton;
 extern Serial serial;
 extern int32_t second_counter;
+extern volatile uint16_t tick_counter;
+
+// PID gain schedule bands, band 0 range is taken from the running profile
+extern GainBand ee_gainbands[GAIN_BANDS];
 
  
+// profile step. setpoint ramps from previous step target to this one
+// in given number of seconds, and then holds until the oven reaches it.
+// the per second setpoint increment is computed at compile time by
+// PROFILE_STEP so that no division is needed when running the profile
+//
 struct ProfileStep
 {
-  enum STEP { PROCESS_DONE=-1, DOOR_OPEN=-2, DOOR_CLOSE=-3 };
-  int temp;    // desired temperature at the end of the step, or one of enums
-  int seconds; // minimum number of seconds the step lasts
+  enum FLAGS { DOOR_OPEN=1, DOOR_CLOSE=2, DOWN=4, PROCESS_DONE=8 };
+  int16_t temp;      // desired temperature at the end of the step (degc)
+  uint16_t seconds;  // minimum number of seconds the step lasts
+  int16_t increment; // setpoint change per second (1/256 degc)
+  uint8_t flags;     // door actions done when step starts, and direction
 };
 
+// step from temperature from to temperature to, flags can have door actions
+#define PROFILE_STEP(from,to,seconds,flags) \
+  { (to),(seconds), \
+    (int16_t)(((to)-(from))*256L/((seconds)?(seconds):1)), \
+    (uint8_t)((flags)|((to)<(from)?ProfileStep::DOWN:0)) }
+// terminates step list
+#define PROFILE_DONE { 0,0,0,ProfileStep::PROCESS_DONE }
+
+// built-in profiles and their steps are in flash
 struct Profile {
-  ProfileStep *steps; // actual profile
-  int lowcritical;      // low limit of critical temperature range around liquous
-  int highcritical;     // high limit of critical temperature range around liquous
+  const ProfileStep *steps; // actual profile
+  int16_t lowcritical;      // low limit of critical temperature range around liquous
+  int16_t highcritical;     // high limit of critical temperature range around liquous
 };
 
+// uploaded profiles are stored in EEPROM slots, the step list is
+// terminated with PROFILE_DONE. crc covers everything before it
+#define PROFILE_SLOTS 3
+#define PROFILE_MAXSTEPS 16
+// temperature the first step of uploaded profile is assumed to start from
+#define PROFILE_START_TEMP 25
+
+struct StoredProfile {
+  uint8_t stepcount;   // 0 for empty slot
+  int16_t lowcritical;
+  int16_t highcritical;
+  ProfileStep steps[PROFILE_MAXSTEPS+1];
+  uint16_t crc;
+};
+
+// uploaded profile, as it comes in a serial frame. temperatures are
+// little-endian int16_t, seconds uint16_t, flags can have door actions
+//   lowcritical,highcritical,{ temp,seconds,flags }...
+#define PROFILE_UPLOAD_HEADER 4
+#define PROFILE_UPLOAD_STEP 5
+#define PROFILE_UPLOAD_MAX (PROFILE_UPLOAD_HEADER+PROFILE_MAXSTEPS*PROFILE_UPLOAD_STEP)
+
 class Process 
 {
-  enum PROCESS_STATE { STOPPED,STARTING,RUNNING,STOPPING,FAULT,BLINKING };
+  friend struct Benchmark; // host benchmarks drive ProcessTick() directly
+  enum PROCESS_STATE { STOPPED,STARTING,RUNNING,STOPPING,FAULT,BLINKING,
+                       MANUAL,TUNING };
   PROCESS_STATE state;
-  unsigned int timestamp;
+  int32_t timestamp; // second_counter on last pass
   int16_t pidoutput;
-  Profile *profile;
-  ProfileStep *step;
+  int16_t zoneoutput[OVEN_ZONES]; // PID output of zones 1.., zone 0 has pidoutput
+  int16_t ffoutput;
+  int16_t ffgain;              // feed-forward gain (1/256)
+  uint8_t fflead;
+  bool predictive;             // model predictive control instead of PID
+  Profile profile;
+  const ProfileStep *nextstep; // in flash or EEPROM
+  bool stepsineeprom;
+  ProfileStep step;            // copy of current step
+  ProfileStep following;       // copy of step after it
   uint8_t pwmcounter;
-  float targettemp,setpointstep,setpoint;
-  int minimumtime,runningtime;
+  int16_t targettemp;
+  int32_t setpoint;            // 1/256 degc
+  uint16_t runningtime;
+  uint16_t droppedlines;
+  uint16_t telemetryinterval;  // ticks
+  uint16_t telemetrycountdown; // ticks to next record
+  uint16_t lasttick;
+  uint32_t telemetryticks;     // ticks since start
+  uint16_t telemetryseconds;   // same as seconds and ticks, for text
+  uint16_t telemetryfraction;
+  TelemetryDecimator decimator;
+  TelemetryEncoder encoder;
+  RelayTuner tuner;
+  RelayTuner::RULE tunerule;
+  float tunesetpoint;
+  RunLog runlog;
    
-  void SetProfile(Profile *p);
+  void SetProfile(const Profile *p);
+  bool SetStoredProfile(uint8_t slot);
+  void BeginProfile();
+  void LoadGainSchedule();
+  void ReadStep(const ProfileStep *from,ProfileStep& to);
+  bool NextStep();
+  bool TargetReached(float v,float tolerance);
+  void RunZones();
   void ProcessTick();
+  int16_t FeedForward();
+  bool SendTelemetry(float v);
+  void StartTelemetry();
+  void Telemetry();
+  void StartSession();
+  void ManualTick(float v);
+  void TuneTick(float v);
   
 public:
   Process();
   void Run();
+  // go to and hold temperature with PID, returns false if busy
+  bool Manual(float setpoint);
+  // relay autotune around setpoint, returns false if busy
+  bool Autotune(float setpoint,RelayTuner::RULE rule);
+  // stop whatever is running
+  void Stop();
+  // apply PID coefficents from settings to a profile or manual run
+  void UpdatePID();
+
+  // true when nothing is running
+  bool Idle() { return state==STOPPED; }
+  // store uploaded profile, returns false if busy or profile is invalid
+  bool StoreProfile(uint8_t slot,const uint8_t *data,uint8_t len);
+  static uint8_t StoredProfileSteps(uint8_t slot,int16_t& low,int16_t& high);
 
 };
 
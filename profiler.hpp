@@ -0,0 +1,180 @@
+/* The MIT License (MIT)
+
+  Copyright (c) 2017 Madis Kaal <mast@nomad.ee>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+#ifndef __profiler_hpp__
+#define __profiler_hpp__
+
+#include <avr/io.h>
+#include <util/atomic.h>
+#include "serial.hpp"
+
+// 1 to build in execution time profiling. this takes timer1 and about
+// 120 bytes of RAM, and adds a few dozen cycles to every measured section
+#ifndef PROFILER
+#define PROFILER 0
+#endif
+
+// timer1 runs free at F_CPU/8, so times are measured in 8 cycle units
+// and sections longer than 32mS wrap around
+#define PROFILER_PRESCALE 8
+
+// measured sections, the names for report are in same order
+enum PROFILE_SECTION {
+  PROFILE_TIMER,     // whole timer interrupt
+  PROFILE_SERVO,
+  PROFILE_SENSOR,
+  PROFILE_OVEN,
+  PROFILE_BUTTONS,
+  PROFILE_CLOCK,     // second counter
+  PROFILE_PROCESS,   // Process::Run()
+  PROFILE_SERIAL,    // ProcessSerialInput()
+  PROFILE_SECTIONS
+};
+
+// wake to sleep time histogram has power of two bins starting from 128
+// cycles, the last one collects everything over 256k cycles
+#define PROFILE_BINS 13
+
+struct ProfileStat {
+  uint16_t min,max;  // timer1 counts
+  uint32_t total;
+  uint32_t count;
+};
+
+#if PROFILER
+// start measuring a section, v is a local variable to keep start time in
+#define PROFILE_START(v) uint16_t v=TCNT1
+#define PROFILE_END(section,v) profiler.Record(section,v)
+#define PROFILE_WAKE(v) profiler.RecordWake(v)
+#else
+#define PROFILE_START(v)
+#define PROFILE_END(section,v)
+#define PROFILE_WAKE(v)
+#endif
+
+class Profiler
+{
+  ProfileStat stats[PROFILE_SECTIONS];
+  uint16_t wakes[PROFILE_BINS];
+
+  static void PrintCycles(uint32_t counts)
+  {
+    serial.print((int32_t)(counts*PROFILER_PRESCALE));
+  }
+
+public:
+
+  Profiler()
+  {
+    Clear();
+  }
+
+  void Enable()
+  {
+    TCCR1A=0;
+    TCCR1B=_BV(CS11); // normal mode, F_CPU/8
+  }
+
+  void Clear()
+  {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      for (uint8_t i=0;i<PROFILE_SECTIONS;i++) {
+        stats[i].min=0xffff;
+        stats[i].max=0;
+        stats[i].total=0;
+        stats[i].count=0;
+      }
+      for (uint8_t i=0;i<PROFILE_BINS;i++)
+        wakes[i]=0;
+    }
+  }
+
+  // record section that started at timer1 count start. time spent in
+  // interrupt handlers is included for main loop sections
+  void Record(uint8_t section,uint16_t start)
+  {
+    uint16_t t=TCNT1-start;
+    ProfileStat& s=stats[section];
+    if (t<s.min)
+      s.min=t;
+    if (t>s.max)
+      s.max=t;
+    s.total+=t;
+    s.count++;
+  }
+
+  // record time from wakeup at timer1 count start to going back to sleep
+  void RecordWake(uint16_t start)
+  {
+    uint16_t t=(TCNT1-start)>>4;
+    uint8_t bin=0;
+    while (t && bin<PROFILE_BINS-1) {
+      bin++;
+      t>>=1;
+    }
+    if (wakes[bin]<0xffff)
+      wakes[bin]++;
+  }
+
+  // print statistics in cycles and clear them for next round
+  void Report()
+  {
+    static const char names[PROFILE_SECTIONS][10] PROGMEM={
+      "timer isr","servo","sensor","oven","buttons","clock","process",
+      "serial" };
+    ProfileStat s;
+    serial.print(FSTR("\n#Profile (cycles min,mean,max,count)\n"));
+    for (uint8_t i=0;i<PROFILE_SECTIONS;i++) {
+      ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        s=stats[i];
+      }
+      serial.print(FSTR("# "));
+      serial.print(reinterpret_cast<const FlashString*>(names[i]));
+      serial.print(FSTR(": "));
+      if (s.count) {
+        PrintCycles(s.min);
+        serial.send(',');
+        PrintCycles(s.total/s.count);
+        serial.send(',');
+        PrintCycles(s.max);
+        serial.send(',');
+        serial.print((int32_t)s.count);
+      }
+      serial.send('\n');
+    }
+    serial.print(FSTR("#Wake to sleep (cycles below,count)\n"));
+    for (uint8_t i=0;i<PROFILE_BINS;i++) {
+      serial.print(FSTR("# "));
+      if (i<PROFILE_BINS-1)
+        PrintCycles(16L<<i);
+      else
+        serial.print(FSTR("more"));
+      serial.send(',');
+      serial.print((int32_t)wakes[i]);
+      serial.send('\n');
+    }
+    Clear();
+  }
+
+};
+
+#endif
@@ -30,15 +30,18 @@
 #include "button.hpp"
 #include "pid.hpp"
 #include "serial.hpp"
+#include "telemetry.hpp"
 #include "process.hpp"
 #include "servo.hpp"
 #include "settings.hpp"
 #include "oven.hpp"
+#include "profiler.hpp"
+#include "scheduler.hpp"
 
-uint16_t tick_counter;
+volatile uint16_t tick_counter;
 int32_t second_counter;
+uint32_t uptime;
 
-TemperatureSensor sensor;
 Button startbutton;
 Button profilebutton;
 Serial serial;
@@ -46,22 +49,93 @@ Process process;
 Servo doorservo;
 Settings settings;
 Oven oven;
+#if PROFILER
+Profiler profiler;
+#endif
 
-extern PID pidcontroller;
+void ProcessSerialInput();
+
+void ServoTask()
+{
+  doorservo.Pulse();
+}
+
+void SensorTask()
+{
+  oven.ReadSensors();
+}
+
+void OvenTask()
+{
+  oven.Run();
+}
+
+void ButtonTask()
+{
+  profilebutton.Update(PINB&_BV(PB1));
+  startbutton.Update(PIND&_BV(PD2));
+}
+
+void ClockTask()
+{
+  second_counter++;
+  uptime++;
+}
+
+void ProcessTask()
+{
+  process.Run();
+}
+
+static const char task_servo[] PROGMEM = "servo";
+static const char task_sensor[] PROGMEM = "sensor";
+static const char task_oven[] PROGMEM = "oven";
+static const char task_buttons[] PROGMEM = "buttons";
+static const char task_clock[] PROGMEM = "clock";
+static const char task_process[] PROGMEM = "process";
+static const char task_serial[] PROGMEM = "serial";
+
+// everything periodic, in 4mS ticks
+static const Task tasks[] = {
+  { task_servo,ServoTask,5,0,TASK_ISR,PROFILE_SERVO },          // 20mS pulses
+  { task_sensor,SensorTask,SENSOR_INTERVAL,2,TASK_ISR,PROFILE_SENSOR },
+  { task_oven,OvenTask,1,0,TASK_ISR,PROFILE_OVEN },
+  { task_buttons,ButtonTask,1,0,TASK_ISR,PROFILE_BUTTONS },
+  { task_clock,ClockTask,TICKS_PER_SECOND,TICKS_PER_SECOND-1,TASK_ISR,PROFILE_CLOCK },
+  { task_process,ProcessTask,1,0,TASK_DEFERRED,PROFILE_PROCESS },
+  { task_serial,ProcessSerialInput,1,0,TASK_DEFERRED,PROFILE_SERIAL },
+};
+
+Scheduler scheduler(tasks,sizeof(tasks)/sizeof(tasks[0]));
 
 Settings EEMEM ee_settings {
  0.0, // thermocouple reading compensation (degc)
  16.0,0.05,2.1, // PID controller parameters
  240, // servo position for closed door
- 124 // servo position for open door
+ 124, // servo position for open door
+ TELEMETRY_TEXT, // telemetry format
+ 0, // built-in profile
+ 0.0, // feed-forward gain, 0 for none
+ 0, // feed-forward lead (seconds)
+ CONTROLLER_PID, // profile controller
+ 2.5,200.0,8, // oven model heating rate, time constant and dead time
+ HEATER_PWM, // heater modulation
+ 3, // minimum heater on/off time for sigma-delta, 3 ticks is 12mS
+ SENSOR_ALPHABETA, // thermocouple reading filter
+ 1.0, // seconds between telemetry records
+ STEP_RESET, // PID is reset at every profile step
+ 1.0, // setpoint weight, 1 for none
+ {0} // zone setpoint offsets
 };
 
 void Help()
 {
-  serial.print(
+  serial.print(FSTR(
     "\n#Commands"
     "\n# ? this help"
     "\n# g go to temperature"
+    "\n# a autotune PID"
+    "\n# x stop"
     "\n# s settings"
     "\n# t current temperature"
     "\n# o open door"
@@ -72,21 +146,93 @@ void Help()
     "\n# D set PID D"
     "\n# O set door open position"
     "\n# C set door closed position"
+    "\n# M set telemetry mode"
+    "\n# S select profile"
+    "\n# U upload profile"
+    "\n# L list uploaded profiles"
+    "\n# F set feed-forward gain"
+    "\n# A set feed-forward lead"
+    "\n# K select controller"
+    "\n# R set model heating rate"
+    "\n# Y set model time constant"
+    "\n# X set model dead time"
+    "\n# H set heater modulation"
+    "\n# N set heater minimum on/off ticks"
+    "\n# E set sensor filter"
+    "\n# W set telemetry interval"
+    "\n# G set PID gain band"
+    "\n# B set step transition"
+    "\n# V set setpoint weight"
+    "\n# Z set zone offset"
+    "\n# p execution time profile"
+    "\n# h run history"
     "\n"
-  );
+  ));
+}
+
+void PrintGainBands()
+{
+  GainBand b;
+  for (uint8_t i=0;i<GAIN_BANDS;i++) {
+    eeprom_read_block(&b,&ee_gainbands[i],sizeof(b));
+    serial.print(FSTR("# gain band "));
+    serial.print((int32_t)i);
+    if (b.P==0.0) {
+      serial.print(FSTR(": off\n"));
+      continue;
+    }
+    if (i==0)
+      serial.print(FSTR(": critical range"));
+    else {
+      serial.print(FSTR(": "));
+      serial.print((int32_t)b.low);
+      serial.send('-');
+      serial.print((int32_t)b.high);
+    }
+    serial.print(FSTR(" P "));
+    serial.print(b.P);
+    serial.print(FSTR(" I "));
+    serial.print(b.I);
+    serial.print(FSTR(" D "));
+    serial.print(b.D);
+    serial.send('\n');
+  }
 }
 
 void ReadSettings()
 {
   eeprom_read_block(&settings,&ee_settings,sizeof(settings));
-  serial.print("\n#Settings\n");
-  serial.print("# temperature comp: ",settings.temperature_compensation);
-  serial.print("# P: ",settings.P);
-  serial.print("# I: ",settings.I);
-  serial.print("# D: ",settings.D);
-  serial.print("# door open position: ",(int32_t)settings.door_open_position);
-  serial.print("# door closed position: ",(int32_t)settings.door_closed_position);
-  serial.print("\n");
+  oven.SetCompensation(settings.temperature_compensation);
+  oven.SetFilter(settings.sensor_filter);
+  oven.SetModulation(settings.heater_modulation,settings.heater_minticks);
+  serial.print(FSTR("\n#Settings\n"));
+  serial.print(FSTR("# temperature comp: "),settings.temperature_compensation);
+  serial.print(FSTR("# P: "),settings.P);
+  serial.print(FSTR("# I: "),settings.I);
+  serial.print(FSTR("# D: "),settings.D);
+  serial.print(FSTR("# door open position: "),(int32_t)settings.door_open_position);
+  serial.print(FSTR("# door closed position: "),(int32_t)settings.door_closed_position);
+  serial.print(FSTR("# telemetry mode: "),(int32_t)settings.telemetry);
+  serial.print(FSTR("# profile: "),(int32_t)settings.profile);
+  serial.print(FSTR("# feed-forward gain: "),settings.FF);
+  serial.print(FSTR("# feed-forward lead: "),(int32_t)settings.FFlead);
+  serial.print(FSTR("# controller: "),(int32_t)settings.controller);
+  serial.print(FSTR("# model heating rate: "),settings.model_rate);
+  serial.print(FSTR("# model time constant: "),settings.model_tau);
+  serial.print(FSTR("# model dead time: "),(int32_t)settings.model_deadtime);
+  serial.print(FSTR("# heater modulation: "),(int32_t)settings.heater_modulation);
+  serial.print(FSTR("# heater minimum ticks: "),(int32_t)settings.heater_minticks);
+  serial.print(FSTR("# sensor filter: "),(int32_t)settings.sensor_filter);
+  serial.print(FSTR("# telemetry interval: "),settings.telemetry_interval);
+  serial.print(FSTR("# step transition: "),(int32_t)settings.step_transition);
+  serial.print(FSTR("# setpoint weight: "),settings.setpoint_weight);
+  for (uint8_t i=1;i<OVEN_ZONES;i++) {
+    serial.print(FSTR("# zone "));
+    serial.print((int32_t)i);
+    serial.print(FSTR(" offset: "),(int32_t)settings.zone_offset[i]);
+  }
+  PrintGainBands();
+  serial.send('\n');
 }
 
 void WriteSettings()
@@ -94,225 +240,485 @@ void WriteSettings()
   eeprom_write_block(&settings,&ee_settings,sizeof(settings));
 }
 
-bool Input(char *buf,uint8_t buflen)
+// serial input is taken a byte at a time as it arrives, so that control
+// keeps running while the user types. commands are single characters,
+// some of them then ask for value lines, or a binary frame
+enum INPUT_STATE { INPUT_COMMAND,INPUT_LINE,INPUT_FRAME };
+
+// seconds to wait for profile upload frame
+#define INPUT_FRAMETIMEOUT 5
+
+static uint8_t inputstate;
+static char inputcommand;  // command the value line is for
+static uint8_t inputstage; // number of values already entered for it
+static float inputfirst;   // first value of two value commands
+static char line[16];
+static uint8_t linelen;
+static uint8_t frame[PROFILE_UPLOAD_MAX+4]; // room for CRC and COBS overhead
+static uint8_t framelen;
+static bool framestarted;
+static int32_t framestart;
+static GainBand inputband;
+
+// commands that set a value in settings
+enum SETTING_TYPE { SETTING_FLOAT,SETTING_BYTE };
+
+struct SettingCommand {
+  char command;
+  uint8_t type;
+  void *value;
+  uint8_t max;        // highest value accepted for SETTING_BYTE
+  const char *prompt; // in flash
+};
+
+static const char prompt_T[] PROGMEM = "#Enter temperature compensation:";
+static const char prompt_P[] PROGMEM = "#Enter PID P value:";
+static const char prompt_I[] PROGMEM = "#Enter PID I value:";
+static const char prompt_D[] PROGMEM = "#Enter PID D value:";
+static const char prompt_O[] PROGMEM = "#Enter door open position:";
+static const char prompt_C[] PROGMEM = "#Enter door closed position:";
+static const char prompt_M[] PROGMEM = "#Enter telemetry mode (0 text, 1 binary, 2 delta):";
+static const char prompt_S[] PROGMEM = "#Enter profile (0 built-in, 1.. uploaded):";
+static const char prompt_F[] PROGMEM = "#Enter feed-forward gain:";
+static const char prompt_A[] PROGMEM = "#Enter feed-forward lead seconds:";
+static const char prompt_K[] PROGMEM = "#Enter controller (0 PID, 1 predictive):";
+static const char prompt_R[] PROGMEM = "#Enter model heating rate (degc/s):";
+static const char prompt_Y[] PROGMEM = "#Enter model time constant (s):";
+static const char prompt_X[] PROGMEM = "#Enter model dead time (s):";
+static const char prompt_H[] PROGMEM = "#Enter heater modulation (0 PWM, 1 sigma-delta):";
+static const char prompt_N[] PROGMEM = "#Enter heater minimum on/off ticks:";
+static const char prompt_E[] PROGMEM = "#Enter sensor filter (0 average, 1 alpha-beta):";
+static const char prompt_W[] PROGMEM = "#Enter telemetry interval (s):";
+static const char prompt_B[] PROGMEM = "#Enter step transition (0 reset, 1 bumpless):";
+static const char prompt_V[] PROGMEM = "#Enter setpoint weight (0-1):";
+
+static const SettingCommand settingcommands[] PROGMEM = {
+  { 'T',SETTING_FLOAT,&settings.temperature_compensation,0,prompt_T },
+  { 'P',SETTING_FLOAT,&settings.P,0,prompt_P },
+  { 'I',SETTING_FLOAT,&settings.I,0,prompt_I },
+  { 'D',SETTING_FLOAT,&settings.D,0,prompt_D },
+  { 'O',SETTING_BYTE,&settings.door_open_position,255,prompt_O },
+  { 'C',SETTING_BYTE,&settings.door_closed_position,255,prompt_C },
+  { 'M',SETTING_BYTE,&settings.telemetry,TELEMETRY_DELTA,prompt_M },
+  { 'S',SETTING_BYTE,&settings.profile,PROFILE_SLOTS,prompt_S },
+  { 'F',SETTING_FLOAT,&settings.FF,0,prompt_F },
+  { 'A',SETTING_BYTE,&settings.FFlead,255,prompt_A },
+  { 'K',SETTING_BYTE,&settings.controller,CONTROLLER_PREDICTIVE,prompt_K },
+  { 'R',SETTING_FLOAT,&settings.model_rate,0,prompt_R },
+  { 'Y',SETTING_FLOAT,&settings.model_tau,0,prompt_Y },
+  { 'X',SETTING_BYTE,&settings.model_deadtime,255,prompt_X },
+  { 'H',SETTING_BYTE,&settings.heater_modulation,HEATER_SIGMADELTA,prompt_H },
+  { 'N',SETTING_BYTE,&settings.heater_minticks,255,prompt_N },
+  { 'E',SETTING_BYTE,&settings.sensor_filter,SENSOR_ALPHABETA,prompt_E },
+  { 'W',SETTING_FLOAT,&settings.telemetry_interval,0,prompt_W },
+  { 'B',SETTING_BYTE,&settings.step_transition,STEP_BUMPLESS,prompt_B },
+  { 'V',SETTING_FLOAT,&settings.setpoint_weight,0,prompt_V },
+};
+
+// copies the table entry for command c to s, returns false if there is
+// no such setting
+static bool FindSetting(char c,SettingCommand& s)
 {
-  uint8_t c;
-  if (!buf || buflen<1)
-    return false;
-  while (buflen) {
-    wdt_reset();
-    WDTCSR|=0x40;
-    if (serial.rxready()) {
-      c=serial.receive();
-      if (c=='\n') {
-        *buf='\0';
-        return true;              
-      }
-      if (c=='\x1b') {
-        return false;
-      }
-      *buf++=c;
-      buflen--;
+  for (uint8_t i=0;i<sizeof(settingcommands)/sizeof(settingcommands[0]);i++) {
+    if (pgm_read_byte(&settingcommands[i].command)==c) {
+      memcpy_P(&s,&settingcommands[i],sizeof(s));
+      return true;
     }
   }
   return false;
 }
 
-bool InputFloat(float& f)
+// parse a decimal number, empty string is not one
+bool ParseFloat(const char *s,float& f)
 {
-  char buf[16],*s;
   bool neg=false;
   int32_t v=0;
   uint8_t dp=0;
   f=0.0;
-  if (Input(buf,sizeof buf)) {
-    s=buf;
-    while (*s) {
-      switch (*s) {
-        case '\0':
-          break;
-        case '-':
-          neg=true;
-          break;
-        case '.':
-          dp=1;
-          break;
-        default:
-          if (*s>='0' && *s<='9') {
-            v=v*10+(*s-'0');
-            if (dp)
-              dp++;
-          }
-          else
-            return false;
-          break;
-      }
-      s++;
-    }
-    int32_t d=1;
-    while (dp>1) {
-      dp--;
-      d*=10;
+  if (!*s)
+    return false;
+  while (*s) {
+    switch (*s) {
+      case '-':
+        neg=true;
+        break;
+      case '.':
+        dp=1;
+        break;
+      default:
+        if (*s>='0' && *s<='9') {
+          v=v*10+(*s-'0');
+          if (dp)
+            dp++;
+        }
+        else
+          return false;
+        break;
     }
-    if (neg)
-      v=0-v;
-    f=float(v)/(float)d;
-    return true;
+    s++;
   }
-  return false;
+  int32_t d=1;
+  while (dp>1) {
+    dp--;
+    d*=10;
+  }
+  if (neg)
+    v=0-v;
+  f=float(v)/(float)d;
+  return true;
 }
 
-void ModifySetting(const char * prompt,float& f)
+// prompt for a value line for command c
+void AskValue(char c,const FlashString *prompt)
 {
-float v;
-  serial.print("\n");
+  serial.send('\n');
   serial.print(prompt);
-  serial.print("\n");
-  if (InputFloat(v)) {
-    f=v;
-    WriteSettings();
-    ReadSettings();
-  }
+  serial.send('\n');
+  inputcommand=c;
+  linelen=0;
+  inputstate=INPUT_LINE;
 }
 
-void ModifySetting(const char * prompt,uint8_t& u)
+void AskSlot()
 {
-float v;
-  serial.print("\n");
-  serial.print(prompt);
-  serial.print("\n");
-  if (InputFloat(v)) {
-    u=(uint8_t)v;
-    WriteSettings();
-    ReadSettings();
+  serial.print(FSTR("\n#Enter profile slot (1-"));
+  serial.print((int32_t)PROFILE_SLOTS);
+  serial.print(FSTR("):\n"));
+  inputcommand='U';
+  linelen=0;
+  inputstate=INPUT_LINE;
+}
+
+void ListProfiles()
+{
+int16_t low,high;
+uint8_t n;
+  serial.print(FSTR("\n#Uploaded profiles\n"));
+  for (uint8_t i=0;i<PROFILE_SLOTS;i++) {
+    serial.print(FSTR("# "));
+    serial.print((int32_t)i+1);
+    n=Process::StoredProfileSteps(i,low,high);
+    if (n) {
+      serial.print(FSTR(": steps "));
+      serial.print((int32_t)n);
+      serial.print(FSTR(", critical "));
+      serial.print((int32_t)low);
+      serial.send('-');
+      serial.print((int32_t)high);
+      serial.send('\n');
+    }
+    else
+      serial.print(FSTR(": empty\n"));
   }
 }
 
+// gain band is entered as band number, range unless it is the critical
+// range band, and P, I and D. P of 0 turns the band off
+void GainInput(float f)
+{
+  switch (inputstage++) {
+    case 0:
+      if (f<0 || f>=GAIN_BANDS) {
+        serial.print(FSTR("#Invalid band\n"));
+        return;
+      }
+      inputfirst=f;
+      inputband.low=inputband.high=0;
+      if (f<1) {
+        inputstage=3;
+        AskValue('G',FSTR("#Enter band P value (0 for off):"));
+      }
+      else
+        AskValue('G',FSTR("#Enter band low temperature:"));
+      return;
+    case 1:
+      inputband.low=(int16_t)f;
+      AskValue('G',FSTR("#Enter band high temperature:"));
+      return;
+    case 2:
+      inputband.high=(int16_t)f;
+      AskValue('G',FSTR("#Enter band P value (0 for off):"));
+      return;
+    case 3:
+      inputband.P=f;
+      inputband.I=inputband.D=0.0;
+      if (f==0.0)
+        break;
+      AskValue('G',FSTR("#Enter band I value:"));
+      return;
+    case 4:
+      inputband.I=f;
+      AskValue('G',FSTR("#Enter band D value:"));
+      return;
+    default:
+      inputband.D=f;
+      break;
+  }
+  eeprom_update_block(&inputband,&ee_gainbands[(uint8_t)inputfirst],
+    sizeof(inputband));
+  ReadSettings();
+}
 
-void ProcessSerialInput()
+// zone offset is entered as zone number and offset in degc
+void ZoneInput(float f)
 {
-static uint8_t busy;
-float f;
-int16_t pidoutput;
-int32_t oc;
-  if (busy)
+  if (inputstage++==0) {
+    if (f<1 || f>=OVEN_ZONES) {
+      serial.print(FSTR("#Invalid zone\n"));
+      return;
+    }
+    inputfirst=f;
+    AskValue('Z',FSTR("#Enter zone offset (degc):"));
     return;
-  busy++;
-  if (serial.rxready()) {
-    switch (serial.receive()) {
-      case 'g':
-        pidcontroller.SetOutputLimits(-127,127);
-        pidcontroller.SetCoefficents(settings.P,settings.I,settings.D);
-        pidcontroller.Reset();
-        serial.print("\n#Enter setpoint:\n");
-        if (InputFloat(f)) {
-          oven.Reset();
-          pidcontroller.SetSetPoint(f);
-          second_counter=0;
-          oc=-1;
-          serial.print("\nStarting\n");
-          serial.print("time#i4,sepoint#f4,temperature#f4,output#i4,integrator#f4\n");
-          while (!serial.rxready()) {
-            if (oc!=second_counter) {
-              oc=second_counter;
-              f=oven.Temperature();
-              pidoutput=pidcontroller.ProcessInput(f);
-              oven.SetPWM(pidoutput>=0?pidoutput:0);
-              serial.print(second_counter);
-              serial.send(',');
-              serial.print(pidcontroller.GetSetPoint());
-              serial.send(',');
-              serial.print(f);
-              serial.send(',');
-              serial.print((int32_t)pidoutput);
-              serial.send(',');
-              serial.print(pidcontroller.GetIntegral());
-              serial.send('\n');
-            }
-            wdt_reset();
-            WDTCSR|=0x40;
-          }
-          oven.Reset();
-          serial.receive();
-          serial.print("Stopping\n");
-        }
-        break;
-      case 's':
-        ReadSettings();
-        break;
-      case '?':
-        Help();
-        break;
-      case 'o':
-        doorservo.SetPosition(settings.door_open_position);
-        serial.print("\n#Door open\n");
-        break;
-      case 'c':
-        doorservo.SetPosition(settings.door_closed_position);
-        serial.print("\n#Door closed\n");
-        break;
-      case 't':
-        serial.print("\n#Current temperature: ");
-        serial.print(sensor.Read());
-        serial.print("\n");
+  }
+  if (f<-100 || f>100) {
+    serial.print(FSTR("#Invalid offset\n"));
+    return;
+  }
+  settings.zone_offset[(uint8_t)inputfirst]=(int8_t)f;
+  WriteSettings();
+  ReadSettings();
+}
+
+// act on a complete value line. inputstate is left to INPUT_COMMAND,
+// unless the command asks for more
+void ValueEntered(float f)
+{
+SettingCommand s;
+  inputstate=INPUT_COMMAND;
+  switch (inputcommand) {
+    case 'g':
+      if (!process.Manual(f))
+        serial.print(FSTR("#Busy\n"));
+      break;
+    case 'a':
+      if (inputstage==0) {
+        inputfirst=f;
+        inputstage++;
+        AskValue('a',FSTR("#Enter rule (0 Ziegler-Nichols, 1 Tyreus-Luyben, 2 no overshoot):"));
+      }
+      else if (f<0 || f>=RelayTuner::RULES)
+        serial.print(FSTR("#Invalid rule\n"));
+      else if (!process.Autotune(inputfirst,(RelayTuner::RULE)f))
+        serial.print(FSTR("#Busy\n"));
+      break;
+    case 'G':
+      GainInput(f);
+      break;
+    case 'Z':
+      ZoneInput(f);
+      break;
+    case 'U':
+      if (!process.Idle()) {
+        serial.print(FSTR("#Busy\n"));
         break;
-      case 'T':
-        ModifySetting("#Enter temperature compensation:",settings.temperature_compensation);
+      }
+      if (f<1 || f>PROFILE_SLOTS) {
+        serial.print(FSTR("#Invalid slot\n"));
         break;
-      case 'P':
-        ModifySetting("#Enter PID P value:",settings.P);
+      }
+      inputfirst=f;
+      framelen=0;
+      framestarted=false;
+      framestart=second_counter;
+      inputstate=INPUT_FRAME;
+      serial.print(FSTR("#Send profile\n"));
+      break;
+    default:
+      if (!FindSetting(inputcommand,s))
         break;
-      case 'I':
-        ModifySetting("#Enter PID I value:",settings.I);
+      if (s.type==SETTING_FLOAT)
+        *(float*)s.value=f;
+      else if (f<0 || f>s.max) {
+        serial.print(FSTR("#Invalid value\n"));
         break;
-      case 'D':
-        ModifySetting("#Enter PID D value:",settings.D);
+      }
+      else
+        *(uint8_t*)s.value=(uint8_t)f;
+      WriteSettings();
+      ReadSettings();
+      if (s.value==&settings.P || s.value==&settings.I ||
+          s.value==&settings.D)
+        process.UpdatePID();
+      break;
+  }
+}
+
+void LineInput(char c)
+{
+  float f;
+  switch (c) {
+    case '\x1b':
+      inputstate=INPUT_COMMAND;
+      break;
+    case '\r':
+      break;
+    case '\n':
+      line[linelen]='\0';
+      if (ParseFloat(line,f))
+        ValueEntered(f);
+      else {
+        if (inputcommand=='U')
+          serial.print(FSTR("#Invalid slot\n"));
+        else if (inputcommand=='a' && inputstage)
+          serial.print(FSTR("#Invalid rule\n"));
+        inputstate=INPUT_COMMAND;
+      }
+      break;
+    default:
+      // overlong line is not a number anyway
+      if (linelen<sizeof(line)-1)
+        line[linelen++]=c;
+      else
+        line[0]='x';
+      break;
+  }
+}
+
+void FrameDone(uint8_t len)
+{
+  inputstate=INPUT_COMMAND;
+  if (len && process.StoreProfile((uint8_t)inputfirst-1,frame,len))
+    serial.print(FSTR("#Profile stored\n"));
+  else
+    serial.print(FSTR("#Profile upload failed\n"));
+}
+
+void FrameInput(uint8_t c)
+{
+  if (!framestarted)
+    framestarted=(c==SERIAL_FRAMESTART);
+  else if (c==0)
+    FrameDone(Serial::decodeframe(frame,framelen));
+  else if (framelen<sizeof(frame))
+    frame[framelen++]=c;
+  else
+    FrameDone(0);
+}
+
+void Command(char c)
+{
+SettingCommand s;
+  switch (c) {
+    case 'g':
+      inputstage=0;
+      AskValue(c,FSTR("#Enter setpoint:"));
+      break;
+    case 'a':
+      inputstage=0;
+      AskValue(c,FSTR("#Enter autotune setpoint:"));
+      break;
+    case 'G':
+      inputstage=0;
+      AskValue(c,FSTR("#Enter gain band (0 critical range, 1.. temperature range):"));
+      break;
+    case 'Z':
+#if OVEN_ZONES>1
+      inputstage=0;
+      AskValue(c,FSTR("#Enter zone (1.. additional zones):"));
+#else
+      serial.print(FSTR("\n#Single zone oven\n"));
+#endif
+      break;
+    case 'x':
+    case '\x1b':
+      process.Stop();
+      break;
+    case 's':
+      ReadSettings();
+      break;
+    case '?':
+      Help();
+      break;
+    case 'o':
+      doorservo.SetPosition(settings.door_open_position);
+      serial.print(FSTR("\n#Door open\n"));
+      break;
+    case 'c':
+      doorservo.SetPosition(settings.door_closed_position);
+      serial.print(FSTR("\n#Door closed\n"));
+      break;
+    case 't':
+      serial.print(FSTR("\n#Current temperature: "));
+      serial.print(oven.Temperature());
+      for (uint8_t i=1;i<OVEN_ZONES;i++) {
+        serial.send(' ');
+        serial.print(oven.Temperature(i));
+      }
+      serial.send('\n');
+      break;
+    case 'p':
+#if PROFILER
+      profiler.Report();
+#else
+      serial.print(FSTR("\n#Profiler not built in\n"));
+#endif
+      scheduler.Report();
+      break;
+    case 'U':
+      AskSlot();
+      break;
+    case 'L':
+      ListProfiles();
+      break;
+    case 'h':
+      RunLog::Print();
+      break;
+    default:
+      if (FindSetting(c,s))
+        AskValue(c,reinterpret_cast<const FlashString*>(s.prompt));
+      break;
+  }
+}
+
+// consume whatever input has arrived, never waits
+void ProcessSerialInput()
+{
+  if (inputstate==INPUT_FRAME &&
+      (second_counter-framestart>=INPUT_FRAMETIMEOUT || second_counter<framestart))
+    FrameDone(0);
+  while (serial.rxready()) {
+    uint8_t c=serial.receive();
+    switch (inputstate) {
+      case INPUT_COMMAND:
+        Command(c);
         break;
-      case 'O':
-        ModifySetting("#Enter door open position:",settings.door_open_position);
+      case INPUT_LINE:
+        LineInput(c);
         break;
-      case 'C':
-        ModifySetting("#Enter door closed position:",settings.door_closed_position);
+      case INPUT_FRAME:
+        FrameInput(c);
         break;
     }
   }
-  busy--;
 }
 
 // screen /dev/tty.usbserial-A50285BI 38400,n,8,1
 
-ISR(TIMER0_OVF_vect)
+ISR(TIMER0_COMPA_vect)
 {
-static uint8_t sensorcounter,servocounter,ovencounter;
-  // reset timer for next interrupt
-  TCNT0=2;
-  servocounter++;
-  if (servocounter>4) {
-    doorservo.Pulse();
-    servocounter=0;
-  }
+  PROFILE_START(isrstart);
+  tick_counter++;
+  scheduler.Tick();
+  PROFILE_END(PROFILE_TIMER,isrstart);
+}
 
-  sensorcounter++;
-  if (sensorcounter>59) {
-    sensor.RawRead();
-    sensorcounter=0;
-  }
+ISR(USART_UDRE_vect)
+{
+  serial.TxInterrupt();
+}
 
-  ovencounter++;
-  if (ovencounter>0) {
-    oven.Run();
-    ovencounter=0;
-  }
-  
-  tick_counter++;
-  if (tick_counter>=246) { // 246 for 1 second
-    tick_counter=0;
-    second_counter++;
-  }
+ISR(USART_RX_vect)
+{
+  serial.RxInterrupt();
+}
 
-  profilebutton.Update(PINB&_BV(PB1));
-  startbutton.Update(PIND&_BV(PD2));
+#if MAX6675_HWSPI
+ISR(SPI_STC_vect)
+{
+  oven.SpiInterrupt();
 }
+#endif
 
 ISR(WDT_vect)
 {
@@ -322,10 +728,10 @@ ISR(WDT_vect)
 I/O configuration
 -----------------
 I/O pin                               direction    DDR  PORT
-PC0 unused                            output       1    1
-PC1 unused                            output       1    1
-PC2 unused                            output       1    1
-PC3 unused                            output       1    1
+PC0 unused, zone 1 MAX6675 CS         output       1    1
+PC1 unused, zone 2 MAX6675 CS         output       1    1
+PC2 unused, zone 1 heating drive      output       1    1 (0 with zones)
+PC3 unused, zone 2 heating drive      output       1    1 (0 with zones)
 PC4 unused                            output       1    1
 PC5 unused                            output       1    1
 
@@ -344,6 +750,11 @@ PB2 MAX6675 DO                        input,p-up   0    1
 PB3 SPI MOSI                          output       1    1
 PB4 SPI MISO                          input, p-up  0    1
 PB5 SPI SCK                           output       1    0
+
+with MAX6675_HWSPI MAX6675 DO is connected to PB4 instead of PB2, and
+PB2 is switched to output by TemperatureSensor::Enable() as SPI needs
+it for master mode. with OVEN_ZONES above 1 the additional zones have
+their MAX6675 chips on the same SCK and DO lines
 */
 int main(void)
 {
@@ -354,7 +765,7 @@ int main(void)
   DDRD=0xf8;
   DDRB=0x29;
   // initial state
-  PORTC=0x3f;
+  PORTC=0x3f&~ZONE_HEATERS_PORTC;
   PORTD=0x14;
   PORTB=0x1f;
   //while ((PINC&4)==0) // wait for INT0 input to go high
@@ -367,17 +778,22 @@ int main(void)
   // configure watchdog
   WDTCSR=(1<<WDE) | (1<<WDCE);
   WDTCSR=(1<<WDE) | (1<<WDIE) | (1<<WDP2) | (1<<WDP1) | (1<<WDP0) ; // 2sec timout, interrupt+reset
-  // configure timer0 for periodic interrupts
-  TCCR0B=4; // timer0 clock prescaler to 256
-  TIMSK0=1; // enable overflow interrupts
+  scheduler.Enable();
   serial.enable();
+  oven.Sensor().Enable();
+#if PROFILER
+  profiler.Enable();
+#endif
   ReadSettings();
   sei();
   while (1) {
-    sleep_cpu(); // any interrupt (which can be only timer or watchdog) wakes up
+    // any interrupt wakes up, serial and SPI ones too, deferred tasks
+    // run only when the timer has made them due
+    sleep_cpu();
+    PROFILE_START(wake);
     wdt_reset();
     WDTCSR=(1<<WDIE) | (1<<WDP2) | (1<<WDP1) | (1<<WDP0) ; // 2sec timout, interrupt+reset
-    process.Run();
-    ProcessSerialInput();
+    scheduler.RunDeferred();
+    PROFILE_WAKE(wake);
   }
 }
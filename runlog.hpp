@@ -0,0 +1,201 @@
+/* The MIT License (MIT)
+
+  Copyright (c) 2017 Madis Kaal <mast@nomad.ee>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+#ifndef __runlog_hpp__
+#define __runlog_hpp__
+
+#include <avr/eeprom.h>
+#include "serial.hpp"
+#include "format.hpp"
+
+extern Serial serial;
+extern uint32_t uptime;
+
+// number of runs remembered. records are written in turn, so each EEPROM
+// cell gets written once in this many runs
+#define RUNLOG_SIZE 16
+
+// summary of one profile run
+struct RunRecord {
+  enum FLAGS { COMPLETE=1, ABORTED=2, FAULT=4, PREDICTIVE=8 };
+  uint16_t sequence;  // run number, 0 or erased 0xffff for empty record
+  uint8_t profile;    // 0 leaded, 1 lead-free, 2.. uploaded slot 1..
+  uint8_t flags;
+  uint32_t start;     // seconds since power up
+  uint16_t seconds;   // run length
+  int16_t peak;       // 1/4 degc
+  uint16_t abovelow;  // seconds at or above profile critical range low limit
+  uint16_t abovehigh; // seconds at or above critical range high limit
+  int8_t maxrise;     // fastest heating, 1/16 degc/s
+  int8_t maxfall;     // fastest cooling
+};
+
+extern RunRecord ee_runlog[RUNLOG_SIZE];
+
+// collects run summary once per second, and writes it to EEPROM ring
+// when the run ends. newest record is the one with highest sequence
+// number, compared with wraparound
+//
+class RunLog
+{
+  RunRecord r;
+  int16_t low,high;
+  bool active;
+
+  static uint16_t Sequence(uint8_t i)
+  {
+    return eeprom_read_word(&ee_runlog[i].sequence);
+  }
+
+  static bool Empty(uint16_t sequence)
+  {
+    return sequence==0 || sequence==0xffff;
+  }
+
+  // index of newest record, or RUNLOG_SIZE if there are none
+  static uint8_t Newest()
+  {
+    uint8_t newest=RUNLOG_SIZE;
+    uint16_t s,best=0;
+    for (uint8_t i=0;i<RUNLOG_SIZE;i++) {
+      s=Sequence(i);
+      if (Empty(s))
+        continue;
+      if (newest==RUNLOG_SIZE || (int16_t)(s-best)>0) {
+        newest=i;
+        best=s;
+      }
+    }
+    return newest;
+  }
+
+  static int8_t Clamp(float v)
+  {
+    if (v>127.0)
+      return 127;
+    if (v<-127.0)
+      return -127;
+    return (int8_t)v;
+  }
+
+public:
+
+  RunLog() : active(false)
+  {
+  }
+
+  void Begin(uint8_t profile,int16_t lowcritical,int16_t highcritical,
+    bool predictive)
+  {
+    r.profile=profile;
+    r.flags=predictive?RunRecord::PREDICTIVE:0;
+    r.start=uptime;
+    r.seconds=0;
+    r.peak=-32768;
+    r.abovelow=0;
+    r.abovehigh=0;
+    r.maxrise=0;
+    r.maxfall=0;
+    low=lowcritical;
+    high=highcritical;
+    active=true;
+  }
+
+  // temperature and its rate once per second
+  void Sample(float v,float rate)
+  {
+    if (!active)
+      return;
+    int16_t t=(int16_t)(v*4.0);
+    int8_t d=Clamp(rate*16.0);
+    if (t>r.peak)
+      r.peak=t;
+    if (v>=low)
+      r.abovelow++;
+    if (v>=high)
+      r.abovehigh++;
+    if (d>r.maxrise)
+      r.maxrise=d;
+    if (d<r.maxfall)
+      r.maxfall=d;
+    r.seconds++;
+  }
+
+  // write the record over the oldest one. sequence is written last, so a
+  // reset in the middle leaves the record empty
+  void End(uint8_t flags)
+  {
+    if (!active)
+      return;
+    active=false;
+    uint8_t i=Newest();
+    if (i==RUNLOG_SIZE) {
+      r.sequence=1;
+      i=0;
+    }
+    else {
+      r.sequence=Sequence(i)+1;
+      if (Empty(r.sequence))
+        r.sequence=1;
+      i=(i+1)%RUNLOG_SIZE;
+    }
+    r.flags|=flags;
+    eeprom_update_word(&ee_runlog[i].sequence,0);
+    eeprom_update_block((const uint8_t*)&r+sizeof(r.sequence),
+      (uint8_t*)&ee_runlog[i]+sizeof(r.sequence),sizeof(r)-sizeof(r.sequence));
+    eeprom_update_word(&ee_runlog[i].sequence,r.sequence);
+  }
+
+  // print stored records oldest first
+  static void Print()
+  {
+    RunRecord e;
+    char buf[64];
+    uint8_t n=Newest();
+    serial.print(FSTR("\n#Run history\n"));
+    serial.print(FSTR("# run,profile,flags,start,seconds,peak,abovelow,abovehigh,"
+      "maxrise,maxfall\n"));
+    if (n==RUNLOG_SIZE)
+      return;
+    for (uint8_t j=1;j<=RUNLOG_SIZE;j++) {
+      uint8_t i=(n+j)%RUNLOG_SIZE;
+      eeprom_read_block(&e,&ee_runlog[i],sizeof(e));
+      if (Empty(e.sequence))
+        continue;
+      Formatter f(buf,sizeof buf);
+      f.Str("# ").Unsigned(e.sequence).Char(',');
+      f.Unsigned(e.profile).Char(',');
+      f.Unsigned(e.flags).Char(',');
+      f.Unsigned(e.start).Char(',');
+      f.Unsigned(e.seconds).Char(',');
+      f.Fixed(e.peak,2,2).Char(',');
+      f.Unsigned(e.abovelow).Char(',');
+      f.Unsigned(e.abovehigh).Char(',');
+      f.Fixed(e.maxrise,4,2).Char(',');
+      f.Fixed(e.maxfall,4,2).Char('\n');
+      serial.write(f);
+    }
+  }
+
+};
+
+#endif
@@ -0,0 +1,144 @@
+/* The MIT License (MIT)
+
+  Copyright (c) 2017 Madis Kaal <mast@nomad.ee>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+#ifndef __scheduler_hpp__
+#define __scheduler_hpp__
+
+#include <avr/io.h>
+#include <util/atomic.h>
+#include "serial.hpp"
+#include "profiler.hpp"
+
+extern Serial serial;
+#if PROFILER
+extern Profiler profiler;
+#endif
+
+// timer0 in CTC mode at F_CPU/256, clearing at 250 counts, interrupts
+// every 4.000mS exactly. reloading the counter in interrupt handler used
+// to lose the interrupt latency on every tick
+#define TICK_PRESCALE 256
+#define TICK_COUNTS 250
+#define TICKS_PER_SECOND (F_CPU/TICK_PRESCALE/TICK_COUNTS)
+
+#define SCHEDULER_MAXTASKS 8
+
+// TASK_ISR tasks run in timer interrupt, these are the short ones that
+// need exact timing. TASK_DEFERRED tasks are only marked due there, and
+// run from main loop
+enum TASK_CONTEXT { TASK_ISR,TASK_DEFERRED };
+
+struct Task {
+  const char *name; // in flash
+  void (*run)();
+  uint8_t period;  // ticks
+  uint8_t phase;   // ticks before first run, to keep tasks apart
+  uint8_t context;
+  uint8_t section; // profiler section
+};
+
+class Scheduler
+{
+  const Task *tasks;
+  uint8_t count;
+  uint8_t countdown[SCHEDULER_MAXTASKS];
+  volatile uint8_t due[SCHEDULER_MAXTASKS];
+  uint16_t missed[SCHEDULER_MAXTASKS]; // periods a deferred task fell behind
+
+public:
+
+  Scheduler(const Task *tasklist,uint8_t n) : tasks(tasklist)
+  {
+    count=n<SCHEDULER_MAXTASKS?n:SCHEDULER_MAXTASKS;
+    for (uint8_t i=0;i<count;i++) {
+      countdown[i]=tasks[i].phase+1;
+      due[i]=0;
+      missed[i]=0;
+    }
+  }
+
+  void Enable()
+  {
+    TCCR0B=0;
+    TCNT0=0;
+    OCR0A=TICK_COUNTS-1;
+    TCCR0A=_BV(WGM01); // CTC, TOP at OCR0A
+    TCCR0B=_BV(CS02);  // F_CPU/256
+    TIMSK0=_BV(OCIE0A);
+  }
+
+  // called from timer interrupt on every tick
+  void Tick()
+  {
+    for (uint8_t i=0;i<count;i++) {
+      if (--countdown[i])
+        continue;
+      const Task& t=tasks[i];
+      countdown[i]=t.period;
+      if (t.context==TASK_ISR) {
+        PROFILE_START(start);
+        t.run();
+        PROFILE_END(t.section,start);
+      }
+      else if (due[i]<255)
+        due[i]++;
+    }
+  }
+
+  // called from main loop, runs deferred tasks that are due
+  void RunDeferred()
+  {
+    uint8_t n;
+    for (uint8_t i=0;i<count;i++) {
+      ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        n=due[i];
+        due[i]=0;
+      }
+      if (!n)
+        continue;
+      if (n>1 && missed[i]<0xffff-n)
+        missed[i]+=n-1;
+      PROFILE_START(start);
+      tasks[i].run();
+      PROFILE_END(tasks[i].section,start);
+    }
+  }
+
+  // print missed deadlines of deferred tasks and clear them
+  void Report()
+  {
+    serial.print(FSTR("#Missed periods\n"));
+    for (uint8_t i=0;i<count;i++) {
+      if (tasks[i].context!=TASK_DEFERRED)
+        continue;
+      serial.print(FSTR("# "));
+      serial.print(reinterpret_cast<const FlashString*>(tasks[i].name));
+      serial.print(FSTR(": "));
+      serial.print((int32_t)missed[i]);
+      serial.send('\n');
+      missed[i]=0;
+    }
+  }
+
+};
+
+#endif
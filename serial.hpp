@@ -23,13 +23,48 @@
 #ifndef __serial_hpp__
 #define __serial_hpp__
 #include <avr/io.h>
+#include <avr/sleep.h>
+#include <avr/pgmspace.h>
+#include <util/crc16.h>
+#include "format.hpp"
 
 #define BAUDRATE 38400L
 #define UBRR (F_CPU/(16*BAUDRATE)-1)
 
+// buffer sizes must be powers of two
+#define SERIAL_TXBUFSIZE 128
+#define SERIAL_RXBUFSIZE 32
+
+// largest binary frame payload
+#define SERIAL_MAXFRAME 32
+// binary frames start with this, text never contains it
+#define SERIAL_FRAMESTART 0x01
+
+// text kept in flash instead of being copied to RAM at startup, made
+// with FSTR("text"). it is a type of its own so that print() can tell it
+// from strings in RAM
+class FlashString;
+#define FSTR(s) (reinterpret_cast<const FlashString*>(PSTR(s)))
+
+// interrupt driven serial port. transmitted data is queued in a ring buffer
+// that the data register empty interrupt drains, received data is queued by
+// the receive interrupt. TxInterrupt() and RxInterrupt() must be called
+// from USART_UDRE and USART_RX interrupt handlers
+//
 class Serial
 {
+  uint8_t txbuf[SERIAL_TXBUFSIZE];
+  uint8_t rxbuf[SERIAL_RXBUFSIZE];
+  volatile uint8_t txhead,txtail;
+  volatile uint8_t rxhead,rxtail;
+
 public:
+
+  Serial()
+  {
+    txhead=txtail=0;
+    rxhead=rxtail=0;
+  }
   
   void enable()
   {
@@ -38,7 +73,7 @@ public:
       PORTD|=0x01;
       UBRR0H=(unsigned char)(UBRR>>8);
       UBRR0L=(unsigned char)UBRR;
-      UCSR0B=(1<<RXEN0)|(1<<TXEN0);
+      UCSR0B=(1<<RXEN0)|(1<<TXEN0)|(1<<RXCIE0);
       UCSR0C=(1<<USBS0)|(3<<UCSZ00);
     }
   }
@@ -49,56 +84,214 @@ public:
       UCSR0B=0;
       DDRD&=0xfc;
       PORTD&=0xfc;
+      txhead=txtail=0;
+      rxhead=rxtail=0;
+    }
+  }
+
+  // moves next queued byte to transmitter, disables the interrupt
+  // when there is nothing more to send
+  void TxInterrupt()
+  {
+    if (txhead==txtail) {
+      UCSR0B&=~(1<<UDRIE0);
+      return;
+    }
+    UDR0=txbuf[txtail];
+    txtail=(txtail+1)&(SERIAL_TXBUFSIZE-1);
+  }
+  
+  // queues received byte, it is dropped if the buffer is full
+  void RxInterrupt()
+  {
+    uint8_t c=UDR0;
+    uint8_t h=(rxhead+1)&(SERIAL_RXBUFSIZE-1);
+    if (h!=rxtail) {
+      rxbuf[rxhead]=c;
+      rxhead=h;
     }
   }
 
   bool rxready()
   {
-    return (UCSR0A&(1<<RXC0));
+    return rxhead!=rxtail;
   }  
   
+  // wait for the interrupts to move some data. sleeps until the next
+  // interrupt, or services the port by polling if interrupts are not
+  // enabled yet
+  void wait()
+  {
+    if (SREG&0x80)
+      sleep_cpu();
+    else {
+      if (UCSR0A&(1<<UDRE0))
+        TxInterrupt();
+      if (UCSR0A&(1<<RXC0))
+        RxInterrupt();
+    }
+  }
+
   uint8_t receive()
   {
-    while (!rxready()); // this blocks the caller if no data received
-    return UDR0;
+    while (!rxready()) // this blocks the caller if no data received
+      wait();
+    uint8_t c=rxbuf[rxtail];
+    rxtail=(rxtail+1)&(SERIAL_RXBUFSIZE-1);
+    return c;
+  }
+
+  // number of bytes that can be queued for sending without waiting
+  uint8_t txfree()
+  {
+    return (txtail-txhead-1)&(SERIAL_TXBUFSIZE-1);
   }
 
+  // queue a byte for sending, returns false if the buffer is full
+  bool trysend(uint8_t c)
+  {
+    uint8_t h=(txhead+1)&(SERIAL_TXBUFSIZE-1);
+    if (h==txtail)
+      return false;
+    txbuf[txhead]=c;
+    txhead=h;
+    UCSR0B|=(1<<UDRIE0);
+    return true;
+  }
+
+  // queue a byte for sending, waits for room if the buffer is full
   void send(uint8_t c)  
   {
-    while (!(UCSR0A&(1<<UDRE0)));
-    UDR0 = c;
+    while (!trysend(c))
+      wait();
+  }
+
+  // queue len bytes, copying as much as fits at a time and waiting for
+  // room for the rest
+  void write(const char *s,uint8_t len)
+  {
+    uint8_t n,h;
+    while (len) {
+      n=txfree();
+      if (!n) {
+        wait();
+        continue;
+      }
+      if (n>len)
+        n=len;
+      len-=n;
+      h=txhead;
+      while (n--) {
+        txbuf[h]=*s++;
+        h=(h+1)&(SERIAL_TXBUFSIZE-1);
+      }
+      txhead=h;
+      UCSR0B|=(1<<UDRIE0);
+    }
+  }
+
+  // queue formatted text
+  void write(Formatter& f)
+  {
+    write(f.Data(),f.Length());
+  }
+
+  // queue a string only if it fits in the buffer in full, returns
+  // false without sending anything if it does not
+  bool tryprint(const char *s)
+  {
+    uint16_t n=0;
+    while (s && s[n])
+      n++;
+    if (n>txfree())
+      return false;
+    print(s);
+    return true;
   }
   
+  // send a binary frame: SERIAL_FRAMESTART, data with CRC-16/XMODEM
+  // appended and COBS encoded, and a zero byte as terminator. the frame
+  // is only queued if it fits in the buffer in full, returns false if
+  // it did not
+  bool sendframe(const void *data,uint8_t len)
+  {
+    uint8_t buf[SERIAL_MAXFRAME+2];
+    const uint8_t *d=(const uint8_t*)data;
+    uint16_t crc=0;
+    uint8_t i,start;
+    if (len>SERIAL_MAXFRAME || txfree()<len+5)
+      return false;
+    for (i=0;i<len;i++) {
+      buf[i]=d[i];
+      crc=_crc_xmodem_update(crc,d[i]);
+    }
+    buf[len++]=crc>>8;
+    buf[len++]=crc&0xff;
+    send(SERIAL_FRAMESTART);
+    start=0;
+    for (i=0;i<=len;i++) {
+      if (i==len || buf[i]==0) { // each zero becomes a count to next one
+        send(i-start+1);
+        while (start<i)
+          send(buf[start++]);
+        start=i+1;
+      }
+    }
+    send(0);
+    return true;
+  }
+
+  // decode a received frame in place, buf has the bytes between
+  // SERIAL_FRAMESTART and the terminating zero. returns payload length,
+  // or 0 if the frame is broken or its CRC does not match
+  static uint8_t decodeframe(uint8_t *buf,uint8_t len)
+  {
+    uint8_t i=0,o=0,n;
+    uint16_t crc=0;
+    while (i<len) {
+      n=buf[i];
+      if (n==0 || (uint16_t)i+n>len)
+        return 0;
+      while (--n)
+        buf[o++]=buf[++i];
+      i++;
+      if (i<len)
+        buf[o++]=0;
+    }
+    if (o<3)
+      return 0;
+    for (i=0;i<o;i++)
+      crc=_crc_xmodem_update(crc,buf[i]);
+    return crc?0:o-2;
+  }
+
   void print(const char *s)
   {
     while (s && *s)
       send(*s++);
   }
   
+  void print(const FlashString *s)
+  {
+    const char *p=reinterpret_cast<const char*>(s);
+    char c;
+    while ((c=pgm_read_byte(p++)))
+      send(c);
+  }
+
   void print(int32_t n)
   {
-    if (n<0) {
-      send('-');
-      n=0-n;
-    }
-    if (n>9)
-      print(n/10);
-    send((n%10)+'0');
+    char buf[12];
+    Formatter f(buf,sizeof buf);
+    write(f.Int(n));
   }
 
+  // prints with 3 decimals
   void print(float v)
   {
-     int n;
-     print((int32_t)v);
-     if (v<0.0)
-       v=0.0-v;
-     send('.');
-     n=(v-(int32_t)v)*1000;
-     send(n/100+'0');
-     n=n%100;
-     send(n/10+'0');
-     n=n%10;
-     send(n+'0');
+    char buf[16];
+    Formatter f(buf,sizeof buf);
+    write(f.Float(v));
   }
   
   void print(const char *s,float v)
@@ -114,6 +307,20 @@ public:
     print(n);
     send('\n');
   }
+
+  void print(const FlashString *s,float v)
+  {
+    print(s);
+    print(v);
+    send('\n');
+  }
+
+  void print(const FlashString *s,int32_t n)
+  {
+    print(s);
+    print(n);
+    send('\n');
+  }
     
 };
 
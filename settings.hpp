@@ -25,14 +25,40 @@ SOFTWARE.
 #define __settings_hpp__
 
 #include <avr/io.h>
+#include "zones.hpp"
+
+#define CONTROLLER_PID 0
+#define CONTROLLER_PREDICTIVE 1
+
+#define STEP_RESET 0
+#define STEP_BUMPLESS 1
 
 typedef struct {
   float temperature_compensation; // thermocouple reading compensation (degc)
   float P,I,D; // PID controller parameters
   uint8_t door_closed_position; // servo position for closed door
   uint8_t door_open_position; // servo position for open door
+  uint8_t telemetry; // telemetry format, TELEMETRY_TEXT, _BINARY or _DELTA
+  uint8_t profile; // 0 for built-in profile chosen with button, 1.. uploaded
+  float FF; // feed-forward gain, heater output per degc/s of setpoint ramp
+  uint8_t FFlead; // feed-forward lead for oven dead time (seconds)
+  uint8_t controller; // CONTROLLER_PID or CONTROLLER_PREDICTIVE
+  float model_rate; // oven heating rate at full power (degc/s)
+  float model_tau; // oven cooling time constant (seconds)
+  uint8_t model_deadtime; // heater to thermocouple dead time (seconds)
+  uint8_t heater_modulation; // HEATER_PWM or HEATER_SIGMADELTA
+  uint8_t heater_minticks; // sigma-delta minimum heater on/off time (ticks)
+  uint8_t sensor_filter; // SENSOR_AVERAGE or SENSOR_ALPHABETA
+  float telemetry_interval; // seconds between telemetry records
+  uint8_t step_transition; // STEP_RESET or STEP_BUMPLESS
+  float setpoint_weight; // PID proportional setpoint weight for bumpless steps
+  int8_t zone_offset[OVEN_ZONES]; // zone setpoint offset from profile (degc), zone 0 has none
 } Settings;
 
 extern Settings settings;
 
+// load settings from EEPROM and show them, and save them back
+void ReadSettings();
+void WriteSettings();
+
 #endif
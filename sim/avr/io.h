@@ -0,0 +1,173 @@
+/* The MIT License (MIT)
+
+  Copyright (c) 2017 Madis Kaal <mast@nomad.ee>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+#ifndef __sim_avr_io_h__
+#define __sim_avr_io_h__
+
+// host stand-in for avr-libc <avr/io.h>, just enough of ATmega328p for the
+// firmware sources to compile and run against the simulator. registers are
+// plain objects, the simulator can hook reads and writes to emulate the
+// peripherals behind them
+//
+#include <stdint.h>
+#include <stddef.h>
+
+template <typename T>
+class IORegister
+{
+public:
+  T value;
+  void (*onwrite)(T v);  // called after every write with the new value
+  T (*onread)(T v);      // called on every read, returns the value seen
+
+  operator T() const { return onread?onread(value):value; }
+  IORegister& operator=(int v) { value=(T)v; if (onwrite) onwrite(value); return *this; }
+  IORegister& operator|=(int v) { return *this=value|v; }
+  IORegister& operator&=(int v) { return *this=value&v; }
+  IORegister& operator^=(int v) { return *this=value^v; }
+};
+
+typedef IORegister<uint8_t> IORegister8;
+typedef IORegister<uint16_t> IORegister16;
+
+#define _BV(bit) (1<<(bit))
+
+extern IORegister8 PINB,DDRB,PORTB;
+extern IORegister8 PINC,DDRC,PORTC;
+extern IORegister8 PIND,DDRD,PORTD;
+extern IORegister8 TCCR0A,TCCR0B,TCNT0,OCR0A,OCR0B,TIMSK0,TIFR0;
+extern IORegister8 TCCR1A,TCCR1B,TCCR1C;
+extern IORegister16 TCNT1;
+extern IORegister8 TCCR2A,TCCR2B,TCNT2,OCR2A,OCR2B,TIMSK2,TIFR2;
+extern IORegister8 SPCR,SPSR,SPDR;
+extern IORegister8 UCSR0A,UCSR0B,UCSR0C,UBRR0L,UBRR0H,UDR0;
+extern IORegister8 MCUSR,MCUCR,WDTCSR,SREG;
+
+#define PB0 0
+#define PB1 1
+#define PB2 2
+#define PB3 3
+#define PB4 4
+#define PB5 5
+#define PB6 6
+#define PB7 7
+
+#define PC0 0
+#define PC1 1
+#define PC2 2
+#define PC3 3
+#define PC4 4
+#define PC5 5
+#define PC6 6
+
+#define PD0 0
+#define PD1 1
+#define PD2 2
+#define PD3 3
+#define PD4 4
+#define PD5 5
+#define PD6 6
+#define PD7 7
+
+// TCCR0A
+#define WGM00 0
+#define WGM01 1
+
+// TCCR0B
+#define CS00 0
+#define CS01 1
+#define CS02 2
+
+// TIMSK0
+#define TOIE0 0
+#define OCIE0A 1
+#define OCIE0B 2
+
+// TCCR1B
+#define CS10 0
+#define CS11 1
+#define CS12 2
+#define WGM12 3
+#define WGM13 4
+
+// SPCR
+#define SPR0 0
+#define SPR1 1
+#define CPHA 2
+#define CPOL 3
+#define MSTR 4
+#define DORD 5
+#define SPE 6
+#define SPIE 7
+
+// SPSR
+#define SPI2X 0
+#define WCOL 6
+#define SPIF 7
+
+// UCSR0A
+#define MPCM0 0
+#define U2X0 1
+#define UPE0 2
+#define DOR0 3
+#define FE0 4
+#define UDRE0 5
+#define TXC0 6
+#define RXC0 7
+
+// UCSR0B
+#define TXB80 0
+#define RXB80 1
+#define UCSZ02 2
+#define TXEN0 3
+#define RXEN0 4
+#define UDRIE0 5
+#define TXCIE0 6
+#define RXCIE0 7
+
+// UCSR0C
+#define UCPOL0 0
+#define UCSZ00 1
+#define UCSZ01 2
+#define USBS0 3
+#define UPM00 4
+#define UPM01 5
+
+// WDTCSR
+#define WDP0 0
+#define WDP1 1
+#define WDP2 2
+#define WDE 3
+#define WDCE 4
+#define WDP3 5
+#define WDIE 6
+#define WDIF 7
+
+// interrupt vectors, numbered as in avr-libc so the names stay unique
+#define WDT_vect __vector_6
+#define TIMER0_COMPA_vect __vector_14
+#define TIMER0_OVF_vect __vector_16
+#define SPI_STC_vect __vector_17
+#define USART_RX_vect __vector_18
+#define USART_UDRE_vect __vector_19
+
+#endif
@@ -0,0 +1,97 @@
+/* The MIT License (MIT)
+
+  Copyright (c) 2017 Madis Kaal <mast@nomad.ee>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+#ifndef __ovenmodel_hpp__
+#define __ovenmodel_hpp__
+
+#include <vector>
+
+// first order plus dead time thermal model of the oven. the heater power
+// reaches the thermocouple after dead_time seconds, and the oven with its
+// load is a single lumped thermal mass losing heat to the room through
+// the walls, the door and the fans
+//
+class OvenModel
+{
+  std::vector<float> delayline; // heater power history covering dead time
+  size_t delayptr;
+  float delaystep;              // time step the delay line was sized for
+
+public:
+  float ambient;         // room temperature (degc)
+  float heater_power;    // heating element power (W)
+  float thermal_mass;    // heat capacity of oven and load (J/degc)
+  float loss;            // heat loss with door closed (W/degc)
+  float door_loss;       // additional loss with door fully open (W/degc)
+  float cooler_loss;     // additional loss with cooling fan on (W/degc)
+  float convection_loss; // additional loss with convection fan on (W/degc)
+  float dead_time;       // heater to thermocouple response delay (s)
+  float temperature;     // current oven temperature (degc)
+
+  OvenModel()
+  {
+    ambient=25.0;
+    heater_power=1500.0;
+    thermal_mass=600.0;
+    loss=3.0;
+    door_loss=8.0;
+    cooler_loss=4.0;
+    convection_loss=0.5;
+    dead_time=8.0;
+    temperature=ambient;
+    delayptr=0;
+    delaystep=0.0;
+  }
+
+  // advance the model by dt seconds with given heater and fan states.
+  // door is the opening fraction, 0.0 for closed and 1.0 for fully open
+  void Step(float dt,bool heater,bool cooler,bool convection,float door)
+  {
+    if (dt!=delaystep) {
+      size_t n=(size_t)(dead_time/dt+0.5);
+      delayline.assign(n?n:1,0.0);
+      delayptr=0;
+      delaystep=dt;
+    }
+    float power=delayline[delayptr];
+    delayline[delayptr]=heater?heater_power:0.0;
+    delayptr=(delayptr+1)%delayline.size();
+    float k=loss+door*door_loss;
+    if (cooler)
+      k+=cooler_loss;
+    if (convection)
+      k+=convection_loss;
+    temperature+=(power-k*(temperature-ambient))*dt/thermal_mass;
+  }
+
+  // heat flow over dt seconds between this and another zone of the same
+  // oven, k is the conductance between them (W/degc)
+  void Exchange(OvenModel& other,float k,float dt)
+  {
+    float q=k*(temperature-other.temperature)*dt;
+    temperature-=q/thermal_mass;
+    other.temperature+=q/other.thermal_mass;
+  }
+
+};
+
+#endif
@@ -0,0 +1,37 @@
+/* The MIT License (MIT)
+
+  Copyright (c) 2017 Madis Kaal <mast@nomad.ee>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+#include <avr/io.h>
+
+// register storage, shared by the simulator and benchmarks. the
+// simulator hooks reads and writes of these to emulate peripherals
+//
+IORegister8 PINB,DDRB,PORTB;
+IORegister8 PINC,DDRC,PORTC;
+IORegister8 PIND,DDRD,PORTD;
+IORegister8 TCCR0A,TCCR0B,TCNT0,OCR0A,OCR0B,TIMSK0,TIFR0;
+IORegister8 TCCR1A,TCCR1B,TCCR1C;
+IORegister16 TCNT1;
+IORegister8 TCCR2A,TCCR2B,TCNT2,OCR2A,OCR2B,TIMSK2,TIFR2;
+IORegister8 SPCR,SPSR,SPDR;
+IORegister8 UCSR0A,UCSR0B,UCSR0C,UBRR0L,UBRR0H,UDR0;
+IORegister8 MCUSR,MCUCR,WDTCSR,SREG;
@@ -0,0 +1,478 @@
+/* The MIT License (MIT)
+
+  Copyright (c) 2017 Madis Kaal <mast@nomad.ee>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+// Host simulator for the reflow controller firmware. The unmodified
+// firmware runs against emulated AVR registers, with the oven replaced by
+// a thermal model. Every sleep_cpu() in the firmware main loop advances
+// virtual time by one timer period, so a complete profile takes
+// milliseconds instead of minutes. Firmware serial output goes to stdout
+// in the same format debuglogger.py reads, a run summary goes to stderr.
+// With OVEN_ZONES above 1 each zone has its own model, coupled to the
+// zones next to it.
+//
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <random>
+#include <string>
+
+#include "ovenmodel.hpp"
+#include "servo.hpp"
+#include "serial.hpp"
+#include "settings.hpp"
+#include "telemetry.hpp"
+#include "zones.hpp"
+
+extern "C" void TIMER0_COMPA_vect(void);
+extern "C" void USART_UDRE_vect(void);
+extern "C" void USART_RX_vect(void);
+extern "C" void SPI_STC_vect(void) __attribute__((weak)); // optional
+int firmware_main(void);
+
+extern Servo doorservo;
+extern Settings ee_settings;
+
+static OvenModel models[OVEN_ZONES];
+static OvenModel& model=models[0]; // zone 0, the options set up this
+static float zonecoupling=10.0; // conductance between zones (W/degc)
+static float zonepower=1.0;     // heater power of zones 1.. relative to zone 0
+static std::mt19937 rng(1);
+static std::normal_distribution<float> noise(0.0,1.0);
+static float noiselevel;       // thermocouple noise standard deviation (degc)
+static double simtime;         // virtual seconds since reset
+static double timer0due;       // virtual time of next timer0 compare match
+static double txdue,rxdue;     // when UART can take or deliver next byte
+static double spidue;          // when SPI transfer completes
+static bool spibusy;
+static std::string rxdata;     // bytes to feed in to firmware serial port
+static size_t rxptr;
+static double starttime_button=1.0; // when start button is clicked
+static double timelimit=1800.0;
+static double starttime=-1.0;  // when firmware reported Starting
+static double peaktime;
+static float peak;
+static float zonepeak[OVEN_ZONES];
+static bool leadfree,quiet,done;
+static struct timespec wallstart;
+
+// MAX6675 thermocouple converter for each zone, zone 0 CS on PB0 and
+// zones 1.. on PC0.., all on PB5 (SCK) and SO on both PB2 for bit-banged
+// reads and PB4 (MISO) for SPI hardware
+//
+static uint16_t max6675_shift[OVEN_ZONES];
+
+// zone that has its CS low, -1 for none
+static int8_t max6675_selected()
+{
+  for (uint8_t z=0;z<OVEN_ZONES;z++) {
+    if (!(ZONE_CS_PORT(z).value&ZONE_CS_BIT(z)))
+      return z;
+  }
+  return -1;
+}
+
+static void max6675(uint8_t)
+{
+static int8_t prevzone=-1;
+static uint8_t prevsck=_BV(PB5);
+  int8_t z=max6675_selected();
+  uint8_t sck=PORTB.value&_BV(PB5);
+  if (z>=0 && z!=prevzone) { // CS falling latches a reading
+    float t=models[z].temperature;
+    if (noiselevel>0.0)
+      t+=noise(rng)*noiselevel;
+    int32_t q=(int32_t)(t*4.0+0.5);
+    if (q<0)
+      q=0;
+    if (q>4095)
+      q=4095;
+    max6675_shift[z]=q<<3;
+  }
+  else if (z>=0 && prevsck && !sck)
+    max6675_shift[z]<<=1; // next bit out on falling SCK
+  if (z>=0) {
+    if (max6675_shift[z]&0x8000)
+      PINB.value|=_BV(PB2);
+    else
+      PINB.value&=~_BV(PB2);
+  }
+  prevzone=z;
+  prevsck=sck;
+}
+
+// SPI hardware, writing data register starts a transfer that shifts
+// 8 bits out of MAX6675 that has its CS low
+static void spi_write(uint8_t v)
+{
+static const uint8_t dividers[4]={ 4,16,64,128 };
+  if (!(SPCR.value&_BV(SPE)) || !(SPCR.value&_BV(MSTR)))
+    return;
+  int8_t z=max6675_selected();
+  if (z>=0) {
+    SPDR.value=max6675_shift[z]>>8;
+    max6675_shift[z]<<=8;
+  }
+  else
+    SPDR.value=0xff;
+  double div=dividers[SPCR.value&3];
+  if (SPSR.value&_BV(SPI2X))
+    div/=2;
+  spidue=simtime+8*div/F_CPU;
+  spibusy=true;
+}
+
+// UART, firmware output is passed through to stdout and watched for the
+// Starting and Stopping lines. bytes move at the configured baud rate with
+// 1 start, 8 data and 2 stop bits
+//
+static double CharTime()
+{
+  uint16_t ubrr=(UBRR0H.value<<8)|UBRR0L.value;
+  return 11.0*16.0*(ubrr+1)/F_CPU;
+}
+
+static void uart_tx(uint8_t c)
+{
+static char line[128];
+static uint8_t len;
+static bool inframe;
+  if (txdue<simtime)
+    txdue=simtime;
+  txdue+=CharTime();
+  if (!quiet)
+    putchar(c);
+  if (inframe || c==SERIAL_FRAMESTART) { // binary frames end with zero
+    inframe=(c!=0);
+    len=0;
+    return;
+  }
+  if (c!='\n') {
+    if (len<sizeof(line)-1)
+      line[len++]=c;
+    return;
+  }
+  line[len]='\0';
+  len=0;
+  if (!strcmp(line,"Starting"))
+    starttime=simtime;
+  else if (!strcmp(line,"Stopping") && starttime>=0.0)
+    done=true;
+}
+
+static uint8_t uart_rx(uint8_t v)
+{
+  if (rxptr>=rxdata.size())
+    return v;
+  rxdue=simtime+CharTime();
+  return rxdata[rxptr++];
+}
+
+static bool RxPending()
+{
+  return rxptr<rxdata.size() && simtime>=0.5; // give the firmware time to boot
+}
+
+// timer1 counter. firmware code takes no virtual time, so the counter
+// runs on host time instead, at the rate it would run on F_CPU. this
+// gives the profiler numbers that compare against each other
+static uint16_t timer1(uint16_t v)
+{
+static const uint16_t prescale[8]={ 0,1,8,64,256,1024,0,0 };
+struct timespec now;
+  uint16_t p=prescale[TCCR1B.value&7];
+  if (!p)
+    return v;
+  clock_gettime(CLOCK_MONOTONIC,&now);
+  double cycles=(now.tv_sec*1e9+now.tv_nsec)*(F_CPU/1e9);
+  return (uint16_t)(uint64_t)(cycles/p);
+}
+
+static uint8_t uart_status(uint8_t v)
+{
+  v|=_BV(UDRE0); // polled transmitter is always ready
+  if (RxPending() && simtime>=rxdue)
+    v|=_BV(RXC0);
+  else
+    v&=~_BV(RXC0);
+  return v;
+}
+
+// servo position as door opening fraction, using the calibrated
+// closed and open positions from settings
+static float DoorOpening()
+{
+  float closed=settings.door_closed_position;
+  float open=settings.door_open_position;
+  if (closed==open)
+    return 0.0;
+  float d=(closed-doorservo.GetPosition())/(closed-open);
+  if (d<0.0)
+    d=0.0;
+  if (d>1.0)
+    d=1.0;
+  return d;
+}
+
+// start button is clicked shortly after reset, profile select button
+// is held down for the whole run if lead-free profile is wanted
+static void Buttons()
+{
+  if (simtime>=starttime_button && simtime<starttime_button+0.2)
+    PIND.value&=~_BV(PD2);
+  else
+    PIND.value|=_BV(PD2);
+  if (leadfree)
+    PINB.value&=~_BV(PB1);
+  else
+    PINB.value|=_BV(PB1);
+}
+
+static void Finish(int code)
+{
+struct timespec now;
+  fflush(stdout);
+  clock_gettime(CLOCK_MONOTONIC,&now);
+  double wall=(now.tv_sec-wallstart.tv_sec)+(now.tv_nsec-wallstart.tv_nsec)/1e9;
+  double run=starttime>=0.0?simtime-starttime:0.0;
+  fprintf(stderr,"# run %s\n",done?"completed":"timed out");
+  fprintf(stderr,"# run time %.1f s, peak %.2f degc at %.1f s\n",
+    run,peak,peaktime-(starttime>=0.0?starttime:0.0));
+  for (uint8_t z=1;z<OVEN_ZONES;z++)
+    fprintf(stderr,"# zone %d peak %.2f degc\n",z,zonepeak[z]);
+  fprintf(stderr,"# simulated %.1f s in %.1f ms, %.0fx real time\n",
+    simtime,wall*1000.0,wall>0.0?simtime/wall:0.0);
+  exit(code);
+}
+
+// called from firmware main loop, runs the oven model and peripherals up
+// to the next interrupt and then services it
+void sleep_cpu(void)
+{
+static const uint16_t prescalers[8]={ 0,1,8,64,256,1024,0,0 };
+static double lasttick;
+  if (done)
+    Finish(0);
+  if (simtime>timelimit)
+    Finish(1);
+  if (!(SREG.value&0x80)) {
+    fprintf(stderr,"# sleeping with interrupts disabled\n");
+    Finish(2);
+  }
+  // peripheral interrupts due before next timer tick go first
+  enum { TIMER0,UDRE,RX,SPI } event=TIMER0;
+  double due=timer0due;
+  if ((UCSR0B.value&_BV(UDRIE0)) && txdue<due) {
+    event=UDRE;
+    due=txdue;
+  }
+  if ((UCSR0B.value&_BV(RXCIE0)) && RxPending() && rxdue<due) {
+    event=RX;
+    due=rxdue;
+  }
+  if (spibusy && spidue<due) {
+    event=SPI;
+    due=spidue;
+  }
+  if (event!=TIMER0) {
+    if (simtime<due)
+      simtime=due;
+    switch (event) {
+      case UDRE:
+        USART_UDRE_vect();
+        break;
+      case RX:
+        USART_RX_vect();
+        break;
+      default:
+        spibusy=false;
+        SPSR.value|=_BV(SPIF);
+        if ((SPCR.value&_BV(SPIE)) && SPI_STC_vect)
+          SPI_STC_vect();
+        break;
+    }
+    return;
+  }
+  uint16_t prescaler=prescalers[TCCR0B.value&7];
+  if (!prescaler || !(TIMSK0.value&_BV(OCIE0A)) ||
+      !(TCCR0A.value&_BV(WGM01))) {
+    fprintf(stderr,"# timer0 is not running in CTC mode\n");
+    Finish(2);
+  }
+  simtime=timer0due;
+  for (uint8_t z=0;z<OVEN_ZONES;z++) {
+    models[z].Step(simtime-lasttick,ZONE_HEATER_PORT(z).value&ZONE_HEATER_BIT(z),
+      PORTD.value&_BV(PD5),PORTD.value&_BV(PD7),DoorOpening());
+    if (z)
+      models[z-1].Exchange(models[z],zonecoupling,simtime-lasttick);
+  }
+  lasttick=simtime;
+  if (starttime>=0.0 && model.temperature>peak) {
+    peak=model.temperature;
+    peaktime=simtime;
+  }
+  for (uint8_t z=1;z<OVEN_ZONES;z++) {
+    if (starttime>=0.0 && models[z].temperature>zonepeak[z])
+      zonepeak[z]=models[z].temperature;
+  }
+  Buttons();
+  TIMER0_COMPA_vect();
+  timer0due=simtime+(OCR0A.value+1)*prescaler/(double)F_CPU;
+}
+
+static bool ReadFile(const char *name,std::string& data)
+{
+  FILE *f=fopen(name,"rb");
+  int c;
+  if (!f) {
+    perror(name);
+    return false;
+  }
+  while ((c=fgetc(f))!=EOF)
+    data+=(char)c;
+  fclose(f);
+  return true;
+}
+
+static void Usage()
+{
+  fprintf(stderr,
+    "usage: reflowsim [options]\n"
+    "  -f        run lead-free profile instead of leaded\n"
+    "  -q        do not print firmware serial output\n"
+    "  -i text   send text to firmware serial port after boot\n"
+    "  -I file   send file contents to firmware serial port after boot\n"
+    "  -s sec    when to click start button (%.1f)\n"
+    "  -b        binary telemetry\n"
+    "  -k p,i,d  PID coefficents instead of EEPROM defaults\n"
+    "  -a degc   ambient temperature (%.1f)\n"
+    "  -w watts  heater power (%.1f)\n"
+    "  -m J/degc oven thermal mass (%.1f)\n"
+    "  -l W/degc heat loss with door closed (%.1f)\n"
+    "  -o W/degc additional loss with door open (%.1f)\n"
+    "  -c W/degc additional loss with cooler on (%.1f)\n"
+    "  -v W/degc additional loss with convection on (%.1f)\n"
+    "  -d sec    dead time (%.1f)\n"
+    "  -n degc   thermocouple noise standard deviation (%.2f)\n"
+    "  -t sec    simulated time limit (%.0f)\n"
+    "  -x W/degc conductance between zones (%.1f)\n"
+    "  -y ratio  heater power of zones 1.. relative to zone 0 (%.2f)\n",
+    starttime_button,model.ambient,model.heater_power,model.thermal_mass,model.loss,
+    model.door_loss,model.cooler_loss,model.convection_loss,model.dead_time,
+    noiselevel,timelimit,zonecoupling,zonepower);
+  exit(2);
+}
+
+int main(int argc,char *argv[])
+{
+int c;
+  while ((c=getopt(argc,argv,"fqbi:I:s:k:a:w:m:l:o:c:v:d:n:t:x:y:"))!=-1) {
+    switch (c) {
+      case 'f':
+        leadfree=true;
+        break;
+      case 'q':
+        quiet=true;
+        break;
+      case 'b':
+        ee_settings.telemetry=TELEMETRY_BINARY;
+        break;
+      case 'i':
+        rxdata+=optarg;
+        break;
+      case 'I':
+        if (!ReadFile(optarg,rxdata))
+          Usage();
+        break;
+      case 's':
+        starttime_button=atof(optarg);
+        break;
+      case 'k':
+        if (sscanf(optarg,"%f,%f,%f",&ee_settings.P,&ee_settings.I,
+                   &ee_settings.D)!=3)
+          Usage();
+        break;
+      case 'a':
+        model.ambient=atof(optarg);
+        break;
+      case 'w':
+        model.heater_power=atof(optarg);
+        break;
+      case 'm':
+        model.thermal_mass=atof(optarg);
+        break;
+      case 'l':
+        model.loss=atof(optarg);
+        break;
+      case 'o':
+        model.door_loss=atof(optarg);
+        break;
+      case 'c':
+        model.cooler_loss=atof(optarg);
+        break;
+      case 'v':
+        model.convection_loss=atof(optarg);
+        break;
+      case 'd':
+        model.dead_time=atof(optarg);
+        break;
+      case 'n':
+        noiselevel=atof(optarg);
+        break;
+      case 't':
+        timelimit=atof(optarg);
+        break;
+      case 'x':
+        zonecoupling=atof(optarg);
+        break;
+      case 'y':
+        zonepower=atof(optarg);
+        break;
+      default:
+        Usage();
+    }
+  }
+  if (optind<argc)
+    Usage();
+  model.temperature=model.ambient;
+  for (uint8_t z=1;z<OVEN_ZONES;z++) {
+    models[z]=model;
+    models[z].heater_power*=zonepower;
+  }
+  PORTB.onwrite=max6675;
+  PORTC.onwrite=max6675;
+  SPDR.onwrite=spi_write;
+  UDR0.onwrite=uart_tx;
+  UDR0.onread=uart_rx;
+  UCSR0A.onread=uart_status;
+  TCNT1.onread=timer1;
+  PINB.value=0xff;
+  PINC.value=0xff;
+  PIND.value=0xff;
+  timer0due=250*256/(double)F_CPU; // first compare match of the 4mS tick
+  clock_gettime(CLOCK_MONOTONIC,&wallstart);
+  return firmware_main();
+}
@@ -0,0 +1,270 @@
+/* The MIT License (MIT)
+ 
+  Copyright (c) 2017 Madis Kaal <mast@nomad.ee>
+ 
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+ 
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+ 
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+#ifndef __telemetry_hpp__
+#define __telemetry_hpp__
+
+#include <stdint.h>
+#include "serial.hpp"
+#include "zones.hpp"
+
+extern Serial serial;
+
+// room needed in serial transmit buffer for one line of text telemetry.
+// lines are skipped rather than waiting for the transmitter when there
+// is less
+#define TELEMETRY_MAXLINE (64+16*(OVEN_ZONES-1))
+
+// values for Settings::telemetry
+#define TELEMETRY_TEXT 0
+#define TELEMETRY_BINARY 1
+#define TELEMETRY_DELTA 2
+
+// in delta mode a full record is still sent at least this often, so that
+// the receiver can recover from a lost frame
+#define TELEMETRY_KEYINTERVAL 32
+
+// fields of zones 1.. appended to records and headers, zone 0 has the
+// fields of single zone oven
+#if OVEN_ZONES>2
+#define TELEMETRY_ZONE_HEADER ",temperature1#<i2/16,pidoutput1#i1," \
+  "temperature2#<i2/16,pidoutput2#i1"
+#define TELEMETRY_ZONE_DELTA_HEADER ",temperature1#i1,pidoutput1#i1," \
+  "temperature2#i1,pidoutput2#i1"
+#define TELEMETRY_ZONE_TEXT_HEADER ",temperature1#f4,pidoutput1#i4," \
+  "temperature2#f4,pidoutput2#i4"
+#elif OVEN_ZONES>1
+#define TELEMETRY_ZONE_HEADER ",temperature1#<i2/16,pidoutput1#i1"
+#define TELEMETRY_ZONE_DELTA_HEADER ",temperature1#i1,pidoutput1#i1"
+#define TELEMETRY_ZONE_TEXT_HEADER ",temperature1#f4,pidoutput1#i4"
+#else
+#define TELEMETRY_ZONE_HEADER ""
+#define TELEMETRY_ZONE_DELTA_HEADER ""
+#define TELEMETRY_ZONE_TEXT_HEADER ""
+#endif
+
+// header describing binary records, in the same name#format convention as
+// text headers. formats are numpy dtypes, /n means the value is scaled up
+// by n. time is in 4mS timer ticks
+#define TELEMETRY_HEADER "time#<u4/250,target#<i2/16,setpoint#<i2/16," \
+  "temperature#<i2/16,pidoutput#i1,integral#<i2/256,feedforward#i1," \
+  "tmin#<i2/16,tmax#<i2/16" TELEMETRY_ZONE_HEADER "\n"
+// delta records have the change of each field from previous record sent,
+// in the units of the full record. the header for them follows the full
+// one as a comment, so that older loggers ignore it
+#define TELEMETRY_DELTA_HEADER "#delta time#<u2,target#i1,setpoint#i1," \
+  "temperature#i1,pidoutput#i1,integral#i1,feedforward#i1,tmin#i1,tmax#i1" \
+  TELEMETRY_ZONE_DELTA_HEADER "\n"
+
+// binary telemetry record, sent as a frame by Serial::sendframe(). this
+// is about a third of the size of a text line and needs no number
+// formatting. temperature is the mean over telemetry interval, and tmin
+// and tmax the extremes. zone temperatures are the latest readings
+//
+struct __attribute__((packed)) ZoneTelemetry
+{
+  int16_t temperature; // measured temperature (1/16 degc)
+  int8_t pidoutput;    // controller output
+};
+
+struct __attribute__((packed)) TelemetryRecord
+{
+  uint32_t time;       // ticks since start
+  int16_t target;      // target temperature (1/16 degc)
+  int16_t setpoint;    // controller setpoint (1/16 degc)
+  int16_t temperature; // measured temperature (1/16 degc)
+  int8_t pidoutput;    // controller output
+  int16_t integral;    // controller integral (1/256)
+  int8_t feedforward;  // feed-forward output
+  int16_t tmin,tmax;   // temperature range (1/16 degc)
+#if OVEN_ZONES>1
+  ZoneTelemetry zones[OVEN_ZONES-1]; // zones 1..
+#endif
+
+  // limited to int16_t range, integral can go past it
+  static int16_t Scale(float v,float scale)
+  {
+    v*=scale;
+    if (v>32767.0)
+      return 32767;
+    if (v<-32768.0)
+      return -32768;
+    return (int16_t)(v<0.0?v-0.5:v+0.5);
+  }
+
+  void Set(uint32_t t,float tgt,float sp,float temp,int16_t out,float integ,
+           int16_t ff,float lo,float hi)
+  {
+    time=t;
+    target=Scale(tgt,16.0);
+    setpoint=Scale(sp,16.0);
+    temperature=Scale(temp,16.0);
+    pidoutput=out;
+    integral=Scale(integ,256.0);
+    feedforward=ff;
+    tmin=Scale(lo,16.0);
+    tmax=Scale(hi,16.0);
+  }
+
+  // fields of zone 1.., not touched by Set()
+  void SetZone(uint8_t z,float temp,int16_t out)
+  {
+#if OVEN_ZONES>1
+    zones[z-1].temperature=Scale(temp,16.0);
+    zones[z-1].pidoutput=out;
+#endif
+  }
+
+  // fill in the record and send it, returns false if there was no room
+  // for it in serial transmit buffer
+  bool Send(uint32_t t,float tgt,float sp,float temp,int16_t out,float integ,
+            int16_t ff)
+  {
+    Set(t,tgt,sp,temp,out,integ,ff,temp,temp);
+    return Send();
+  }
+
+  bool Send()
+  {
+    return serial.sendframe(this,sizeof(*this));
+  }
+};
+
+struct __attribute__((packed)) TelemetryDelta
+{
+  uint16_t time;
+  int8_t target,setpoint,temperature,pidoutput,integral,feedforward;
+  int8_t tmin,tmax;
+#if OVEN_ZONES>1
+  struct __attribute__((packed)) {
+    int8_t temperature,pidoutput;
+  } zones[OVEN_ZONES-1];
+#endif
+};
+
+// sends records as deltas from the previous one sent when they fit,
+// and full records otherwise
+//
+class TelemetryEncoder
+{
+  TelemetryRecord last;
+  uint8_t sincekey; // deltas sent since last full record
+
+  static bool Delta(int8_t& d,int16_t v,int16_t previous)
+  {
+    int16_t n=v-previous;
+    d=n;
+    return n>=-128 && n<=127;
+  }
+
+public:
+
+  TelemetryEncoder()
+  {
+    Reset();
+  }
+
+  // next record will be a full one
+  void Reset()
+  {
+    sincekey=TELEMETRY_KEYINTERVAL;
+  }
+
+  // returns false if there was no room in serial transmit buffer
+  bool Send(TelemetryRecord& r)
+  {
+    TelemetryDelta d;
+    uint32_t dt=r.time-last.time;
+    bool ok=sincekey<TELEMETRY_KEYINTERVAL && dt<=0xffff &&
+      Delta(d.target,r.target,last.target) &&
+      Delta(d.setpoint,r.setpoint,last.setpoint) &&
+      Delta(d.temperature,r.temperature,last.temperature) &&
+      Delta(d.pidoutput,r.pidoutput,last.pidoutput) &&
+      Delta(d.integral,r.integral,last.integral) &&
+      Delta(d.feedforward,r.feedforward,last.feedforward) &&
+      Delta(d.tmin,r.tmin,last.tmin) &&
+      Delta(d.tmax,r.tmax,last.tmax);
+#if OVEN_ZONES>1
+    for (uint8_t i=0;ok && i<OVEN_ZONES-1;i++) {
+      ok=Delta(d.zones[i].temperature,r.zones[i].temperature,
+               last.zones[i].temperature) &&
+         Delta(d.zones[i].pidoutput,r.zones[i].pidoutput,
+               last.zones[i].pidoutput);
+    }
+#endif
+    if (ok) {
+      d.time=dt;
+      if (!serial.sendframe(&d,sizeof(d)))
+        return false;
+      sincekey++;
+    }
+    else {
+      if (!r.Send())
+        return false;
+      sincekey=0;
+    }
+    last=r;
+    return true;
+  }
+};
+
+// collects minimum, maximum and mean of temperature readings, in
+// quarter degrees, over telemetry interval
+//
+class TelemetryDecimator
+{
+  int16_t min,max;
+  int32_t sum;
+  uint16_t count;
+
+public:
+
+  TelemetryDecimator()
+  {
+    Clear();
+  }
+
+  void Clear()
+  {
+    min=0x7fff;
+    max=-0x7fff;
+    sum=0;
+    count=0;
+  }
+
+  void Add(int16_t q)
+  {
+    if (q<min)
+      min=q;
+    if (q>max)
+      max=q;
+    sum+=q;
+    count++;
+  }
+
+  bool Empty() { return count==0; }
+  float Min() { return min/4.0; }
+  float Max() { return max/4.0; }
+  float Mean() { return sum/(4.0*count); }
+};
+
+#endif
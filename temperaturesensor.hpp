@@ -25,23 +25,60 @@
 
 #include <avr/io.h>
 #include <util/delay.h>
-#include "settings.hpp"
+#include <util/atomic.h>
+#include "zones.hpp"
 
 #ifndef COUNTOF
  #define COUNTOF(x) (sizeof(x)/sizeof(x[0]))
 #endif
 
-// MAX6675 thermocouple interface with moving average filtering
+// 1 to read MAX6675 with SPI hardware instead of bit-banging. this needs
+// MAX6675 SO connected to MISO (PB4) instead of PB2, as PB2 is then used
+// as SPI SS output
+#ifndef MAX6675_HWSPI
+#define MAX6675_HWSPI 0
+#endif
+
+// timer ticks between MAX6675 reads. a read restarts the conversion,
+// which takes up to 220mS. 55 ticks of 4mS would be exactly that, so
+// 56 ticks, 224mS, keeps one tick of margin for tick jitter and clock
+// tolerance
+#define SENSOR_INTERVAL 56
+#define SENSOR_SECONDS (SENSOR_INTERVAL*0.004)
+
+// reading filters
+#define SENSOR_AVERAGE 0
+#define SENSOR_ALPHABETA 1
+
+// alpha-beta filter gains in 1/256 units. beta is alpha^2/(2-alpha) for
+// critically damped response, alpha of 1/4 gives about the noise
+// reduction of 4 sample average but follows ramps without lag
+#define SENSOR_ALPHA 64
+#define SENSOR_BETA 9
+
+// MAX6675 thermocouple interface with moving average or alpha-beta
+// filtering. the reading is kept in quarter degrees, the native
+// resolution of MAX6675, so that RawRead() can run in interrupt handler
+// without floating point. zone selects the chip select pin
 //
 class TemperatureSensor
 {
 uint16_t reading,avg;
 uint16_t queue[4]; // adjust the size of moving average length
 uint8_t ptr;
-float temperature;
+uint8_t filter;
+bool tracking; // alpha-beta filter has been initialized
+int32_t estimate; // alpha-beta temperature (1/256 quarter degrees)
+int32_t trend; // alpha-beta rate (1/256 quarter degrees per read)
+int16_t compensation; // quarter degrees
+volatile int16_t temperature; // quarter degrees
+volatile int16_t rate; // 1/256 quarter degrees per read, or newest-oldest in queue
+volatile uint8_t spibytes; // bytes received in current SPI read
+uint8_t spihigh; // first byte of SPI read
+uint8_t zone;
 
-  #define CS_LOW() (PORTB&=(~_BV(PB0)))
-  #define CS_HIGH() (PORTB|=_BV(PB0))
+  #define CS_LOW() (ZONE_CS_PORT(zone)&=(~ZONE_CS_BIT(zone)))
+  #define CS_HIGH() (ZONE_CS_PORT(zone)|=ZONE_CS_BIT(zone))
   #define CLK_LOW() (PORTB&=(~_BV(PB5)))
   #define CLK_HIGH() (PORTB|=_BV(PB5))
   #define GET_BIT() ((PINB>>2)&1)
@@ -55,9 +92,54 @@ public:
       queue[ptr]=0;
     ptr=0;
     avg=0;
-    temperature=0.0;
+    filter=SENSOR_AVERAGE;
+    tracking=false;
+    estimate=0;
+    trend=0;
+    compensation=0;
+    temperature=0;
+    rate=0;
+    spibytes=0;
+    spihigh=0;
+    zone=0;
+  }
+
+  void SetZone(uint8_t z)
+  {
+    zone=z;
+  }
+
+  // set up SPI hardware for reading, with clock at 1/16 of F_CPU to
+  // stay under 4.3MHz MAX6675 can do. SS must be an output to keep SPI
+  // in master mode
+  void Enable()
+  {
+#if MAX6675_HWSPI
+    PORTB|=_BV(PB2);
+    DDRB|=_BV(PB2);
+    SPCR=_BV(SPIE)|_BV(SPE)|_BV(MSTR)|_BV(SPR0);
+#endif
+  }
+
+  // set thermocouple reading compensation in degc. this is converted
+  // to quarter degrees here so that reading does not need to do it
+  void SetCompensation(float degc)
+  {
+    int16_t c=(int16_t)(degc<0.0?degc*4.0-0.5:degc*4.0+0.5);
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      compensation=c;
+    }
   }
     
+  // select SENSOR_AVERAGE or SENSOR_ALPHABETA filter
+  void SetFilter(uint8_t f)
+  {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      filter=f;
+      tracking=false;
+    }
+  }
+
   // MAX6675 has a conversion time of up to 220mS. reading the value
   // aborts any ongoing conversion, so the read rate must be limited
   // and RawRead() must not be called more frequently than every 220mS
@@ -74,14 +156,79 @@ public:
       CLK_LOW();
     }
     CS_HIGH();
+    Update(v);
+    return reading;
+  }
+
+  // starts reading the value with SPI hardware, this completes in
+  // SpiInterrupt() after two bytes have been transferred. the same
+  // read rate limit as with RawRead() applies
+  void StartRead()
+  {
+    if (spibytes) // previous read still going on
+      return;
+    CS_LOW();
+    spibytes=1;
+    SPDR=0;
+  }
+
+  // true while SPI read started by StartRead() is going on
+  bool Reading()
+  {
+    return spibytes!=0;
+  }
+
+  // must be called from SPI transfer complete interrupt handler
+  void SpiInterrupt()
+  {
+    if (spibytes==1) {
+      spihigh=SPDR;
+      spibytes=2;
+      SPDR=0;
+      return;
+    }
+    uint8_t low=SPDR;
+    CS_HIGH();
+    spibytes=0;
+    Update(((uint16_t)spihigh<<8)|low);
+  }
+
+  // adds a raw MAX6675 value to moving average, and to alpha-beta filter
+  // if that is used
+  void Update(uint16_t v)
+  {
     reading=v;
     v>>=3;
     avg-=queue[ptr];
     queue[ptr]=v;
     avg+=v;
     ptr=(ptr+1)%COUNTOF(queue);
-    temperature=avg/COUNTOF(queue)/4.0+settings.temperature_compensation;
-    return reading;
+    if (filter==SENSOR_ALPHABETA) {
+      AlphaBeta(v);
+      return;
+    }
+    // newest minus oldest sample in queue, ReadRate() divides it by
+    // the number of reads in between
+    rate=(int16_t)v-(int16_t)queue[ptr];
+    temperature=avg/COUNTOF(queue)+compensation;
+  }
+
+  // predicts temperature from previous estimate and rate, and corrects
+  // both with a fraction of prediction error
+  void AlphaBeta(uint16_t v)
+  {
+    int32_t error;
+    if (!tracking) {
+      estimate=(int32_t)v<<8;
+      trend=0;
+      tracking=true;
+    }
+    estimate+=trend;
+    error=((int32_t)v<<8)-estimate;
+    estimate+=(error*SENSOR_ALPHA)>>8;
+    trend+=(error*SENSOR_BETA)>>8;
+    rate=trend;
+    temperature=((estimate+128)>>8)+compensation;
   }
 
   // returns false if thermocouple is not connected or has failed open
@@ -90,10 +237,32 @@ public:
     return !(reading&0x04);
   }
   
+  // get the latest known temperature in quarter degrees
+  int16_t ReadQuarters()
+  {
+    int16_t t;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      t=temperature;
+    }
+    return t;
+  }
+
   // get the latest known temperature
   float Read()
   {
-    return temperature;
+    return ReadQuarters()/4.0;
+  }
+
+  // get the latest known rate of temperature change in degc/s
+  float ReadRate()
+  {
+    int16_t r;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      r=rate;
+    }
+    if (filter==SENSOR_ALPHABETA)
+      return r/(1024.0*SENSOR_SECONDS);
+    return r/(4.0*(COUNTOF(queue)-1)*SENSOR_SECONDS);
   }
   
 };
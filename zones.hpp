@@ -0,0 +1,50 @@
+/* The MIT License (MIT)
+
+  Copyright (c) 2017 Madis Kaal <mast@nomad.ee>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+#ifndef __zones_hpp__
+#define __zones_hpp__
+
+#include <avr/io.h>
+
+// number of heater and thermocouple channels the oven has. all zones
+// follow the same profile, each with its own PID controller
+#ifndef OVEN_ZONES
+#define OVEN_ZONES 1
+#endif
+
+#if OVEN_ZONES<1 || OVEN_ZONES>3
+#error OVEN_ZONES must be 1 to 3
+#endif
+
+// zone 0 is wired as on single zone oven, MAX6675 CS on PB0 and heater
+// on PD6. zones 1 and 2 have CS on PC0 and PC1 and heaters on PC2 and
+// PC3. all MAX6675 chips share SCK and SO. the zone checks fold away
+// when there is only one zone
+#define ZONE_CS_PORT(z) ((OVEN_ZONES>1 && (z))?PORTC:PORTB)
+#define ZONE_CS_BIT(z) ((OVEN_ZONES>1 && (z))?_BV(PC0+(z)-1):_BV(PB0))
+#define ZONE_HEATER_PORT(z) ((OVEN_ZONES>1 && (z))?PORTC:PORTD)
+#define ZONE_HEATER_BIT(z) ((OVEN_ZONES>1 && (z))?_BV(PC2+(z)-1):_BV(PD6))
+
+// port C heater drive bits, these must start low
+#define ZONE_HEATERS_PORTC (_BV(PC2+OVEN_ZONES-1)-_BV(PC2))
+
+#endif